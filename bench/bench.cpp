@@ -0,0 +1,457 @@
+// Benchmarks for the hot paths, run against a synthetic repository generated
+// from a fixed seed so that runs are comparable. Prints one JSON object.
+//
+//   make bench BENCH_ARGS="--files 20000 --depth 5 --jobs 4"
+
+#define CODETAGS_NO_MAIN
+#include "../main.cpp"
+
+// ======================
+// RepoGenerator
+// ======================
+
+// Writes a tree of source files with code-like lines and a given share of
+// tag lines. Only the raw mt19937 stream is used, never a distribution, so
+// the same options give the same tree everywhere.
+class RepoGenerator {
+public:
+    struct Options {
+        size_t files = 2000;
+        size_t depth = 3;            // directory levels below the root, at most
+        size_t fanout = 6;           // subdirectories per directory
+        size_t lines = 200;          // per file
+        double tag_density = 0.02;   // share of lines holding a tag
+        size_t line_length = 60;
+        size_t ignore_patterns = 20;
+        double unstamped = 0.0;      // share of tags written without a CT- ID
+        uint32_t seed = 1;
+    };
+
+    struct Stats {
+        size_t files = 0;
+        size_t source_files = 0;
+        size_t bytes = 0;
+        size_t tags = 0;  // in source files, i.e. what a scan should find
+    };
+
+    std::vector<std::string> files;       // absolute paths, source files only
+    std::vector<std::string> rel_paths;   // every file, relative to the root
+    std::vector<std::string> patterns;    // .ctagsignore lines
+
+private:
+    Options options;
+    std::mt19937 gen;
+
+    size_t pick(size_t n) { return gen() % n; }
+    bool chance(double p) { return gen() < p * 4294967296.0; }
+
+    void filler(std::string& line) {
+        static const char* words[] = {"value", "result", "index", "buffer", "count", "node", "item", "state",
+                                      "config", "return", "const", "auto", "size", "next", "data", "offset"};
+        static const char* colons[] = {" std::string", " case 3:", " http://example.org", " a ? b : c",
+                                       " label:", " ns::call()"};
+        while (line.size() < options.line_length) {
+            if (pick(8) == 0) {
+                line += colons[pick(std::size(colons))];
+            } else {
+                line += ' ';
+                line += words[pick(std::size(words))];
+                if (pick(4) == 0) line += std::to_string(pick(1000));
+            }
+        }
+    }
+
+public:
+    explicit RepoGenerator(const Options& opts) : options(opts), gen(opts.seed) {
+        // Realistic shapes that the generated names never match, so every
+        // file still counts: the matcher pays for each pattern regardless
+        for (size_t i = 0; i < options.ignore_patterns; ++i) {
+            switch (i % 5) {
+            case 0: patterns.push_back("*.tmp" + std::to_string(i)); break;
+            case 1: patterns.push_back("build" + std::to_string(i) + "/"); break;
+            case 2: patterns.push_back("vendor" + std::to_string(i)); break;
+            case 3: patterns.push_back("gen/**/cache" + std::to_string(i)); break;
+            case 4: patterns.push_back("out" + std::to_string(i) + "_*.o"); break;
+            }
+        }
+    }
+
+    Stats generate(const std::string& root) {
+        static const char* source_exts[] = {".cpp", ".h", ".c", ".py", ".js", ".ts", ".go", ".rs", ".java"};
+        static const char* other_exts[] = {".txt", ".md", ".json"};
+        const auto& types = TagMatcher::default_types();
+
+        Stats stats;
+        fs::create_directories(root);
+        std::ofstream ignore_file(root + "/.ctagsignore");
+        for (const auto& pattern : patterns) ignore_file << pattern << "\n";
+
+        for (size_t i = 0; i < options.files; ++i) {
+            std::string rel;
+            size_t levels = pick(options.depth + 1);
+            for (size_t level = 0; level < levels; ++level) rel += "mod" + std::to_string(pick(options.fanout)) + "/";
+            bool source = pick(10) != 0;
+            std::string ext = source ? source_exts[pick(std::size(source_exts))] : other_exts[pick(std::size(other_exts))];
+            rel += "file" + std::to_string(i) + ext;
+
+            std::string marker = ext == ".py" ? "#" : "//";
+            std::string text;
+            std::string line;
+            for (size_t n = 0; n < options.lines; ++n) {
+                line.clear();
+                if (chance(options.tag_density)) {
+                    line = "    " + marker + " " + types[pick(types.size())] + ":";
+                    if (!chance(options.unstamped)) line += " " + Tag::format_id(static_cast<uint32_t>(gen()));
+                    if (source) stats.tags++;
+                } else if (pick(6) == 0) {
+                    line = "    " + marker;
+                }
+                filler(line);
+                text += line;
+                text += '\n';
+            }
+
+            std::string path = root + "/" + rel;
+            fs::create_directories(fs::path(path).parent_path());
+            std::ofstream(path, std::ios::binary) << text;
+            stats.files++;
+            stats.bytes += text.size();
+            rel_paths.push_back(rel);
+            if (source) {
+                stats.source_files++;
+                files.push_back(path);
+            }
+        }
+        return stats;
+    }
+};
+
+// ======================
+// Bench
+// ======================
+
+class Bench {
+private:
+    struct Result {
+        std::string name;
+        std::string unit;
+        uint64_t ops;
+        double seconds;
+    };
+
+    std::vector<Result> results;
+    std::chrono::duration<double> min_time{0.2};
+
+public:
+    static inline volatile size_t sink = 0;  // keeps results observable
+
+    // Repeats fn, which does ops_per_round units of work, for at least the
+    // minimum time; setup, if given, runs untimed before each round.
+    template <typename Fn>
+    void measure(const std::string& name, const std::string& unit, uint64_t ops_per_round, Fn&& fn,
+                 const std::function<void()>& setup = nullptr) {
+        using Clock = std::chrono::steady_clock;
+        std::chrono::duration<double> elapsed{0};
+        uint64_t ops = 0;
+        do {
+            if (setup) setup();
+            auto start = Clock::now();
+            fn();
+            elapsed += Clock::now() - start;
+            ops += ops_per_round;
+        } while (elapsed < min_time);
+        results.push_back(Result{name, unit, ops, elapsed.count()});
+    }
+
+    void record(const std::string& name, const std::string& unit, uint64_t ops, double seconds) {
+        results.push_back(Result{name, unit, ops, seconds});
+    }
+
+    void print(const RepoGenerator::Options& opts, const RepoGenerator::Stats& stats, size_t jobs) const {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1);
+        out << "{\"benchmark\":\"codetags\",\"config\":{\"files\":" << opts.files << ",\"depth\":" << opts.depth
+            << ",\"lines\":" << opts.lines << ",\"tag_density\":" << std::setprecision(4) << opts.tag_density
+            << ",\"line_length\":" << opts.line_length << ",\"ignore_patterns\":" << opts.ignore_patterns
+            << ",\"unstamped\":" << opts.unstamped << std::setprecision(1) << ",\"seed\":" << opts.seed
+            << ",\"jobs\":" << jobs << "},\"repo\":{\"files\":" << stats.files
+            << ",\"source_files\":" << stats.source_files << ",\"bytes\":" << stats.bytes
+            << ",\"tags\":" << stats.tags << "},\"results\":[";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const auto& r = results[i];
+            out << (i ? "," : "") << "\n{\"name\":\"" << r.name << "\",\"unit\":\"" << r.unit
+                << "\",\"ops\":" << r.ops << ",\"total_ms\":" << r.seconds * 1000
+                << ",\"ns_per_op\":" << r.seconds * 1e9 / std::max<uint64_t>(r.ops, 1)
+                << ",\"ops_per_sec\":" << r.ops / std::max(r.seconds, 1e-9) << "}";
+        }
+        out << "\n]}\n";
+        std::cout << out.str();
+    }
+};
+
+static size_t wait_for_tags(TagDatabase& db, size_t expected, std::chrono::seconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    size_t count = 0;
+    while ((count = db.snapshot().tag_count()) != expected && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return count;
+}
+
+int main(int argc, char* argv[]) {
+    RepoGenerator::Options opts;
+    Config config;
+    std::string root = "/tmp/codetags-bench-" + std::to_string(getpid());
+    size_t storm = 0;
+    bool keep = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        try {
+            if (arg == "--keep") { keep = true; continue; }
+            else if (arg == "--files") opts.files = std::stoul(value);
+            else if (arg == "--depth") opts.depth = std::stoul(value);
+            else if (arg == "--lines") opts.lines = std::stoul(value);
+            else if (arg == "--tag-density") opts.tag_density = std::stod(value);
+            else if (arg == "--line-length") opts.line_length = std::stoul(value);
+            else if (arg == "--ignore-patterns") opts.ignore_patterns = std::stoul(value);
+            else if (arg == "--unstamped") opts.unstamped = std::stod(value);
+            else if (arg == "--seed") opts.seed = static_cast<uint32_t>(std::stoul(value));
+            else if (arg == "--storm") storm = std::stoul(value);
+            else if (arg == "--jobs") config.jobs = std::stoul(value);
+            else if (arg == "--dir") root = value;
+            else {
+                std::cerr << "Unknown option: " << arg << "\n"
+                          << "Options: --files N --depth N --lines N --tag-density F --line-length N\n"
+                          << "         --ignore-patterns N --unstamped F --seed N --storm N --jobs N\n"
+                          << "         --dir PATH --keep\n";
+                return 1;
+            }
+            ++i;
+        } catch (const std::exception&) {
+            std::cerr << "Invalid value for " << arg << ": " << value << "\n";
+            return 1;
+        }
+    }
+    if (storm == 0) storm = std::max<size_t>(1, opts.files / 4);
+
+    std::error_code ec;
+    fs::remove_all(root, ec);
+    RepoGenerator generator(opts);
+    auto stats = generator.generate(root);
+    storm = std::min(storm, generator.files.size());
+    auto pool = std::make_shared<ThreadPool>(config.worker_count());
+    Bench bench;
+
+    // End to end first: the first scan also stamps any unstamped tags, which
+    // leaves the tree as the microbenchmarks below expect it
+    {
+        auto db = std::make_shared<TagDatabase>();
+        auto start = std::chrono::steady_clock::now();
+        FileWatcher watcher(root, db, pool, nullptr, config);
+        watcher.start();
+        watcher.stop();
+        bench.record("scan.initial", "file", stats.source_files,
+                     std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        if (db->snapshot().tag_count() != stats.tags) {
+            std::cerr << "scan found " << db->snapshot().tag_count() << " tags, expected " << stats.tags << "\n";
+        }
+    }
+    {
+        // codetags scan --no-stamp --format json, minus the terminal
+        Config batch = config;
+        batch.batch.stamp = false;
+        batch.batch.format = BatchOptions::JSON;
+        std::ostringstream sink;
+        auto start = std::chrono::steady_clock::now();
+        BatchScan(root, batch, sink).run();
+        bench.record("scan.batch", "file", stats.source_files,
+                     std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    {
+        // A restart with an up-to-date index: stat and reuse, no parsing
+        std::string index_dir = root + ".index";
+        fs::create_directories(index_dir);
+        {
+            FileWatcher warm(root, std::make_shared<TagDatabase>(), pool, nullptr, config, index_dir);
+            warm.start();
+            warm.stop();
+        }
+        auto start = std::chrono::steady_clock::now();
+        FileWatcher watcher(root, std::make_shared<TagDatabase>(), pool, nullptr, config, index_dir);
+        watcher.start();
+        watcher.stop();
+        bench.record("scan.restart", "file", stats.source_files,
+                     std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        fs::remove_all(index_dir, ec);
+    }
+    {
+        // Event storm: rewrite a batch of files at once and time how long the
+        // database takes to hold every new tag
+        EventLoop loop;
+        std::thread loop_thread([&loop] { loop.run(); });
+        auto db = std::make_shared<TagDatabase>();
+        FileWatcher watcher(root, db, pool, &loop, config);
+        watcher.start();
+        wait_for_tags(*db, stats.tags, std::chrono::seconds(120));
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < storm; ++i) {
+            const auto& file = generator.files[i];
+            std::string marker = file.ends_with(".py") ? "#" : "//";
+            std::ofstream(file, std::ios::app) << marker << " NOTE: " << Tag::format_id(0xB0000000u + i)
+                                               << " storm " << i << "\n";
+        }
+        size_t found = wait_for_tags(*db, stats.tags + storm, std::chrono::seconds(120));
+        bench.record("storm.converge", "file", storm,
+                     std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        if (found != stats.tags + storm) {
+            std::cerr << "storm converged to " << found << " tags, expected " << stats.tags + storm << "\n";
+        }
+        watcher.stop();
+        loop.stop();
+        loop_thread.join();
+    }
+
+    // CommentLexer decides which bytes can hold a tag, TagMatcher::find_keyword
+    // whether a comment line does
+    {
+        std::vector<std::vector<char>> contents;
+        std::vector<std::string_view> lines;
+        for (size_t i = 0; i < generator.files.size() && lines.size() < 200000; ++i) {
+            contents.emplace_back();
+            Utils::read_file(generator.files[i], contents.back());
+        }
+        for (const auto& content : contents) {
+            std::string_view text(content.data(), content.size());
+            for (size_t pos = 0; pos < text.size();) {
+                size_t nl = text.find('\n', pos);
+                if (nl == std::string_view::npos) nl = text.size();
+                lines.push_back(text.substr(pos, nl - pos));
+                pos = nl + 1;
+            }
+        }
+        bench.measure("comment_lexer.scan", "file", contents.size(), [&] {
+            size_t comments = 0;
+            for (const auto& content : contents) {
+                CommentLexer<CLikeStyle>::scan(content.data(), content.size(), [&](size_t, size_t) { ++comments; });
+            }
+            Bench::sink = Bench::sink + comments;
+        });
+        auto matcher = TagMatcher::defaults();
+        bench.measure("tag_matcher.find_keyword", "line", lines.size(), [&] {
+            size_t hits = 0;
+            TagMatcher::Match match;
+            for (auto line : lines) hits += matcher->find_keyword(line, match);
+            Bench::sink = Bench::sink + hits;
+        });
+    }
+
+    std::vector<ParsedFile> parsed;
+    {
+        TagParser parser;
+        bench.measure("tag_parser.parse_file", "file", generator.files.size(), [&] {
+            parsed.clear();
+            for (const auto& file : generator.files) {
+                parsed.push_back(ParsedFile{file, parser.parse_file(file, root, 0), std::nullopt, 0});
+            }
+        });
+    }
+
+    {
+        bench.measure("file_watcher.should_ignore", "path", generator.rel_paths.size(), [&] {
+            IgnoreMatcher ignore(generator.patterns);  // fresh, so directory verdicts are computed again
+            size_t ignored = 0;
+            for (const auto& rel : generator.rel_paths) ignored += ignore.matches(rel);
+            Bench::sink = Bench::sink + ignored;
+        });
+    }
+
+    {
+        std::unique_ptr<TagDatabase> db;
+        bench.measure("tag_database.replace_files.insert", "file", parsed.size(),
+                      [&] { db->replace_files(parsed); },
+                      [&] { db = std::make_unique<TagDatabase>(); });
+        bench.measure("tag_database.replace_files.unchanged", "file", parsed.size(),
+                      [&] { db->replace_files(parsed); });
+        bench.measure("tag_database.get_tags_in_file", "file", generator.files.size(), [&] {
+            size_t found = 0;
+            for (const auto& file : generator.files) found += db->get_tags_in_file(file) != nullptr;
+            Bench::sink = Bench::sink + found;
+        });
+        bench.measure("tag_database.snapshot_scan", "tag", stats.tags, [&] {
+            size_t count = 0;
+            db->snapshot().for_each_file([&](const FileTags& file) { count += file.tags.size(); });
+            Bench::sink = Bench::sink + count;
+        });
+        std::vector<std::string> top_dirs;
+        for (size_t i = 0; i < 6; ++i) top_dirs.push_back(root + "/mod" + std::to_string(i));
+        bench.measure("tag_database.move_subtree", "subtree", top_dirs.size() * 2, [&] {
+            for (const auto& dir : top_dirs) {
+                db->move_subtree(dir, dir + "_moved", root);
+                db->move_subtree(dir + "_moved", dir, root);
+            }
+        });
+        bench.measure("tag_database.remove_subtree", "subtree", top_dirs.size(),
+                      [&] {
+                          for (const auto& dir : top_dirs) db->remove_subtree(dir);
+                      },
+                      [&] { db->replace_files(parsed); });
+    }
+
+    {
+        // update_codetags_file: a full render after startup, which finds
+        // codetags.md up to date and leaves it be, then the usual case of one
+        // changed file: its types' sections are rendered again and the rest
+        // of codetags.md is copied over from the file
+        std::unique_ptr<TagDatabase> db;
+        std::unique_ptr<CodetagsRenderer> renderer;
+        bench.measure("update_codetags_file.full", "tag", stats.tags,
+                      [&] { renderer->render(*db); },
+                      [&] {
+                          db = std::make_unique<TagDatabase>();
+                          db->replace_files(parsed);
+                          renderer = std::make_unique<CodetagsRenderer>(root);
+                      });
+
+        size_t victim = 0;
+        while (victim < parsed.size() && !parsed[victim].tags) ++victim;
+        if (victim < parsed.size()) {
+            const auto& original = parsed[victim].tags;
+            uint32_t round = 0;
+            bench.measure("update_codetags_file.one_file", "render", 1,
+                          [&] { renderer->render(*db); },
+                          [&] {
+                              FileTags edited = *original;
+                              edited.last_modified = ++round;
+                              db->replace_file_tags(parsed[victim].file_path,
+                                                    std::make_shared<const FileTags>(std::move(edited)));
+                          });
+        }
+
+        // The machine-readable exports, rendered whole into a hash; as at
+        // startup, the file on disk is found up to date
+        OutputOptions exports;
+        exports.markdown = false;
+        exports.jsonl = true;
+        bench.measure("update_codetags_file.jsonl", "tag", stats.tags, [&] { renderer->render(*db); },
+                      [&] {
+                          db = std::make_unique<TagDatabase>();
+                          db->replace_files(parsed);
+                          renderer = std::make_unique<CodetagsRenderer>(root, exports);
+                      });
+        exports.jsonl = false;
+        exports.binary = true;
+        bench.measure("update_codetags_file.bin", "tag", stats.tags, [&] { renderer->render(*db); },
+                      [&] {
+                          db = std::make_unique<TagDatabase>();
+                          db->replace_files(parsed);
+                          renderer = std::make_unique<CodetagsRenderer>(root, exports);
+                      });
+    }
+
+    bench.print(opts, stats, config.worker_count());
+    if (!keep) fs::remove_all(root, ec);
+    return 0;
+}
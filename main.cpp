@@ -2,24 +2,44 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <cstring>
 #include <vector>
 #include <map>
+#include <utility>
+#include <array>
+#include <optional>
+#include <algorithm>
+#include <cstdint>
 #include <set>
 #include <unordered_map>
 #include <unordered_set>
 #include <filesystem>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
 #include <atomic>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <condition_variable>
 #include <chrono>
 #include <random>
 #include <ctime>
 #include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <fnmatch.h>
 #include <cstdlib>
+#include <cerrno>
 #include <regex>
 #include <iomanip>
 #include <signal.h>
@@ -41,675 +61,5213 @@ public:
 
     static std::string format_time(time_t timestamp) {
         std::stringstream ss;
-        ss << std::put_time(std::localtime(&timestamp), "%Y-%m-%d %H:%M:%S");
+        struct tm local{};
+        localtime_r(&timestamp, &local);
+        ss << std::put_time(&local, "%Y-%m-%d %H:%M:%S");
         return ss.str();
     }
 
     static bool file_exists(const std::string& path) {
         return fs::exists(path);
     }
+
+    static bool is_temp_path(const std::string& path) {
+        return path.find(".ctags-tmp.") != std::string::npos;
+    }
+
+    // Writes through a temp file in the same directory and renames it over
+    // path, so nobody ever sees a half-written file. Keeps the file mode.
+    // If still_current says path changed meanwhile, it is left alone.
+    static bool write_file_atomic(const std::string& path, const std::function<void(std::ostream&)>& writer,
+                                  const std::function<bool()>& still_current = nullptr) {
+        static std::atomic<unsigned long> counter{0};
+        fs::path target(path);
+        std::string tmp = (target.parent_path() / ("." + target.filename().string() + ".ctags-tmp." +
+                           std::to_string(getpid()) + "." + std::to_string(counter++))).string();
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            if (!out.is_open()) return false;
+            writer(out);
+            out.flush();
+            if (!out) {
+                out.close();
+                unlink(tmp.c_str());
+                return false;
+            }
+        }
+
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) chmod(tmp.c_str(), st.st_mode & 07777);
+        if ((still_current && !still_current()) || rename(tmp.c_str(), path.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Keys of a path-keyed std::map that are root itself or lie below it.
+    // The "root/..." keys are one contiguous range, since '/' + 1 == '0'.
+    template <typename Map>
+    static std::vector<std::string> subtree_keys(const Map& map, const std::string& root) {
+        std::vector<std::string> keys;
+        if (map.count(root)) keys.push_back(root);
+        auto end = map.lower_bound(root + char('/' + 1));
+        for (auto it = map.lower_bound(root + '/'); it != end; ++it) {
+            keys.push_back(it->first);
+        }
+        return keys;
+    }
+
+    // True if path is root itself or lies below it.
+    static bool in_subtree(std::string_view path, std::string_view root) {
+        return path.substr(0, root.size()) == root && (path.size() == root.size() || path[root.size()] == '/');
+    }
+
+    static std::string json_escape(std::string_view text) {
+        std::string out;
+        out.reserve(text.size() + 2);
+        for (char c : text) {
+            switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buf[8];
+                    std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+            }
+        }
+        return out;
+    }
+
+    // Percent-encodes everything but unreserved characters and '/'.
+    static std::string url_encode(std::string_view text) {
+        std::string out;
+        for (unsigned char c : text) {
+            if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+                out += static_cast<char>(c);
+            } else {
+                char buf[4];
+                std::snprintf(buf, sizeof(buf), "%%%02X", c);
+                out += buf;
+            }
+        }
+        return out;
+    }
+
+    static std::string url_decode(std::string_view text) {
+        std::string out;
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (text[i] == '%' && i + 2 < text.size() &&
+                std::isxdigit(static_cast<unsigned char>(text[i + 1])) &&
+                std::isxdigit(static_cast<unsigned char>(text[i + 2]))) {
+                out += static_cast<char>(std::stoi(std::string(text.substr(i + 1, 2)), nullptr, 16));
+                i += 2;
+            } else if (text[i] == '+') {
+                out += ' ';
+            } else {
+                out += text[i];
+            }
+        }
+        return out;
+    }
+
+    // Per-thread scratch buffer for chunked file reads.
+    static std::vector<char>& thread_buffer() {
+        static thread_local std::vector<char> buffer;
+        return buffer;
+    }
+
+    static uint64_t hash_bytes(const char* data, size_t size) {
+        constexpr uint64_t mul = 0xff51afd7ed558ccdULL;
+        uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, data + i, 8);
+            h = (h ^ word) * mul;
+            h ^= h >> 32;
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, data + i, size - i);
+        h = (h ^ tail) * mul;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h == 0 ? 1 : h;
+    }
+
+    // read(2), retried if interrupted.
+    static ssize_t read_some(int fd, char* data, size_t size) {
+        ssize_t n;
+        do {
+            n = read(fd, data, size);
+        } while (n < 0 && errno == EINTR);
+        return n;
+    }
+
+    // Reads a whole file into buffer, reusing its existing capacity.
+    static bool read_file(const std::string& path, std::vector<char>& buffer) {
+        buffer.clear();
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            buffer.reserve(static_cast<size_t>(st.st_size));
+        }
+
+        bool ok = true;
+        while (true) {
+            if (buffer.capacity() - buffer.size() < 4096) {
+                buffer.reserve(std::max<size_t>(buffer.capacity() * 2, 16384));
+            }
+            size_t old_size = buffer.size();
+            buffer.resize(buffer.capacity());
+            ssize_t n = read(fd, buffer.data() + old_size, buffer.size() - old_size);
+            if (n < 0 && errno == EINTR) {
+                buffer.resize(old_size);
+                continue;
+            }
+            buffer.resize(old_size + (n > 0 ? static_cast<size_t>(n) : 0));
+            if (n <= 0) {
+                ok = (n == 0);
+                break;
+            }
+        }
+        close(fd);
+        return ok;
+    }
+};
+
+// Hash of a file's contents, fed in chunks of any size.
+class ContentHasher {
+private:
+    static constexpr uint64_t mul = 0xff51afd7ed558ccdULL;
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    uint64_t size = 0;
+    char tail[8] = {};
+    size_t tail_size = 0;
+
+    void mix(const char* word_bytes) {
+        uint64_t word;
+        std::memcpy(&word, word_bytes, 8);
+        h = (h ^ word) * mul;
+        h ^= h >> 32;
+    }
+
+public:
+    void update(const char* data, size_t n) {
+        size += n;
+        if (tail_size > 0) {
+            size_t take = std::min(n, sizeof(tail) - tail_size);
+            std::memcpy(tail + tail_size, data, take);
+            tail_size += take;
+            data += take;
+            n -= take;
+            if (tail_size < sizeof(tail)) return;
+            mix(tail);
+            tail_size = 0;
+        }
+        for (; n >= 8; data += 8, n -= 8) mix(data);
+        std::memcpy(tail, data, n);
+        tail_size = n;
+    }
+
+    uint64_t digest() const {
+        uint64_t word = 0;
+        std::memcpy(&word, tail, tail_size);
+        uint64_t d = (h ^ word ^ size) * mul;
+        d ^= d >> 33;
+        d *= 0xc4ceb9fe1a85ec53ULL;
+        d ^= d >> 33;
+        return d == 0 ? 1 : d;
+    }
+
+    // 0 if the file can't be read.
+    static uint64_t of_file(const std::string& path) {
+        constexpr size_t chunk = 64 << 10;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return 0;
+        std::vector<char>& buffer = Utils::thread_buffer();
+        if (buffer.size() < chunk) buffer.resize(chunk);
+        ContentHasher hasher;
+        ssize_t n;
+        while ((n = Utils::read_some(fd, buffer.data(), buffer.size())) > 0) hasher.update(buffer.data(), n);
+        close(fd);
+        return n == 0 ? hasher.digest() : 0;
+    }
 };
 
 // ======================
-// Tag Struct
+// FileStamp
 // ======================
 
-struct Tag {
-    std::string id;
-    std::string type;
-    std::string content;
-    std::string file_path;
-    std::string relative_path;
-    int line_number;
-    time_t last_modified;
+// Identity of a file's contents as far as stat can tell.
+struct FileStamp {
+    ino_t inode = 0;
+    off_t size = 0;
+    int64_t mtime_ns = 0;
 
-    bool operator==(const Tag& other) const {
-        return id == other.id;
+    static FileStamp from_stat(const struct stat& st) {
+        return {st.st_ino, st.st_size,
+                static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec};
     }
+
+    static std::optional<FileStamp> of(const std::string& path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) return std::nullopt;
+        return from_stat(st);
+    }
+
+    bool operator==(const FileStamp& other) const = default;
 };
 
-namespace std {
-    template<> struct hash<Tag> {
-        size_t operator()(const Tag& t) const {
-            return hash<std::string>()(t.id);
+// ======================
+// Config
+// ======================
+
+// Files the parser won't read past. Either limit keeps a worker from
+// stalling on generated bundles or minified code.
+struct ScanLimits {
+    size_t max_file_size = 8 << 20;     // larger files are skipped
+    size_t max_line_length = 64 << 10;  // longer lines are skipped, the rest of the file is not
+};
+
+// What the renderer writes besides (or instead of) codetags.md.
+struct OutputOptions {
+    bool markdown = true;  // codetags.md
+    bool jsonl = false;    // .codetags/tags.jsonl
+    bool binary = false;   // .codetags/tags.bin
+    enum Split : uint8_t { NONE, TYPE, DIR } split = NONE;  // one markdown file per type or top-level dir
+
+    bool set_formats(const std::string& list) {
+        markdown = jsonl = binary = false;
+        std::stringstream in(list);
+        std::string format;
+        while (std::getline(in, format, ',')) {
+            if (format == "md") markdown = true;
+            else if (format == "jsonl") jsonl = true;
+            else if (format == "bin") binary = true;
+            else return false;
         }
-    };
-}
+        return markdown || jsonl || binary;
+    }
+};
+
+// codetags scan: how tags are printed, and which ones fail the run.
+struct BatchOptions {
+    enum Format : uint8_t { TEXT, JSON } format = TEXT;
+    bool stamp = true;                   // write IDs into files and update codetags.md
+    std::map<std::string, int> fail_on;  // tag type -> exit code
+
+    // "BUG,FIXME=3": the exit code defaults to 1.
+    bool add_fail_on(const std::string& list) {
+        std::stringstream in(list);
+        std::string item;
+        while (std::getline(in, item, ',')) {
+            size_t eq = item.find('=');
+            int code = eq == std::string::npos ? 1 : std::stoi(item.substr(eq + 1));
+            std::string type = item.substr(0, eq);
+            if (type.empty() || code < 1 || code > 255) return false;
+            fail_on[type] = code;
+        }
+        return !fail_on.empty();
+    }
+};
+
+struct Config {
+    size_t jobs = 0;  // 0 = one worker per hardware thread
+    std::chrono::milliseconds debounce{100};  // quiet time before a changed file is parsed
+    std::chrono::milliseconds flush_interval{500};  // minimum time between codetags.md writes
+    bool git_index = false;  // list files from .git/index and batch checkouts
+    ScanLimits limits;
+    OutputOptions outputs;
+    BatchOptions batch;
+
+    size_t worker_count() const {
+        if (jobs > 0) return jobs;
+        unsigned int hw = std::thread::hardware_concurrency();
+        return hw > 0 ? hw : 1;
+    }
+
+    static bool is_flag(const std::string& arg) {
+        return arg == "--git-index" || arg == "--no-stamp";
+    }
+
+    // Parses "--option value" / "--option=value" pairs starting at argv[first].
+    static bool parse(int argc, char* argv[], int first, Config& config) {
+        for (int i = first; i < argc; ++i) {
+            std::string arg = argv[i];
+            std::string value;
+            size_t eq = arg.find('=');
+            if (eq != std::string::npos) {
+                value = arg.substr(eq + 1);
+                arg = arg.substr(0, eq);
+            } else if (i + 1 < argc && arg.rfind("--", 0) == 0 && !is_flag(arg)) {
+                value = argv[++i];
+            }
+
+            try {
+                if (arg == "--git-index") {
+                    config.git_index = true;
+                } else if (arg == "--jobs" || arg == "-j") {
+                    config.jobs = std::stoul(value);
+                } else if (arg == "--flush-ms") {
+                    config.flush_interval = std::chrono::milliseconds(std::stoul(value));
+                } else if (arg == "--debounce-ms") {
+                    config.debounce = std::chrono::milliseconds(std::stoul(value));
+                } else if (arg == "--max-file-kb") {
+                    config.limits.max_file_size = std::stoul(value) << 10;
+                } else if (arg == "--max-line-kb") {
+                    config.limits.max_line_length = std::max<size_t>(std::stoul(value), 1) << 10;
+                } else if (arg == "--outputs") {
+                    if (!config.outputs.set_formats(value)) throw std::invalid_argument(value);
+                } else if (arg == "--split-md") {
+                    if (value == "type") config.outputs.split = OutputOptions::TYPE;
+                    else if (value == "dir") config.outputs.split = OutputOptions::DIR;
+                    else if (value == "none") config.outputs.split = OutputOptions::NONE;
+                    else throw std::invalid_argument(value);
+                } else if (arg == "--format") {
+                    if (value == "text") config.batch.format = BatchOptions::TEXT;
+                    else if (value == "json") config.batch.format = BatchOptions::JSON;
+                    else throw std::invalid_argument(value);
+                } else if (arg == "--no-stamp") {
+                    config.batch.stamp = false;
+                } else if (arg == "--fail-on") {
+                    if (!config.batch.add_fail_on(value)) throw std::invalid_argument(value);
+                } else {
+                    std::cerr << "Unknown option: " << arg << "\n";
+                    return false;
+                }
+            } catch (const std::exception&) {
+                std::cerr << "Invalid value for " << arg << ": " << value << "\n";
+                return false;
+            }
+        }
+        return true;
+    }
+};
 
 // ======================
-// TagDatabase
+// ThreadPool
 // ======================
 
-class TagDatabase {
+// Work-stealing pool: each worker owns a deque, pops its own work LIFO and
+// steals FIFO from the other workers when it runs dry.
+class ThreadPool {
 private:
-    mutable std::mutex db_mutex;
-    std::unordered_map<std::string, Tag> tags_by_id;               // id -> tag
-    std::unordered_map<std::string, std::set<std::string>> file_to_ids; // file -> {ids}
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
 
-public:
-    void add_tag(const Tag& tag) {
-        std::lock_guard<std::mutex> lock(db_mutex);
-        tags_by_id[tag.id] = tag;
-        file_to_ids[tag.file_path].insert(tag.id);
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<bool> running{true};
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> next_queue{0};
+    std::mutex wake_mutex;
+    std::condition_variable wake_cv;
+
+    static inline thread_local ThreadPool* current_pool = nullptr;
+    static inline thread_local size_t current_index = 0;
+
+    bool pop_local(size_t index, std::function<void()>& task) {
+        auto& q = *queues[index];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty()) return false;
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        return true;
     }
 
-    void remove_tag(const std::string& id) {
-        std::lock_guard<std::mutex> lock(db_mutex);
-        auto it = tags_by_id.find(id);
-        if (it != tags_by_id.end()) {
-            file_to_ids[it->second.file_path].erase(id);
-            if (file_to_ids[it->second.file_path].empty()) {
-                file_to_ids.erase(it->second.file_path);
+    bool steal(size_t thief, std::function<void()>& task) {
+        for (size_t n = 1; n <= queues.size(); ++n) {
+            auto& q = *queues[(thief + n) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+                return true;
             }
-            tags_by_id.erase(it);
+        }
+        return false;
+    }
+
+    static void run_task(std::function<void()>& task) {
+        try {
+            task();
+        } catch (const std::exception& e) {
+            std::cerr << "[ThreadPool] Task failed: " << e.what() << std::endl;
+        } catch (...) {
+            std::cerr << "[ThreadPool] Task failed." << std::endl;
         }
     }
 
-    void remove_tags_in_file(const std::string& file_path) {
-        std::lock_guard<std::mutex> lock(db_mutex);
-        auto file_it = file_to_ids.find(file_path);
-        if (file_it != file_to_ids.end()) {
-            for (const auto& id : file_it->second) {
-                tags_by_id.erase(id);
+    void worker_loop(size_t index) {
+        current_pool = this;
+        current_index = index;
+        std::function<void()> task;
+        while (true) {
+            if (pop_local(index, task) || steal(index, task)) {
+                queued--;
+                run_task(task);
+                task = nullptr;
+                continue;
             }
-            file_to_ids.erase(file_it);
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            wake_cv.wait(lock, [this] { return !running || queued > 0; });
+            if (!running && queued == 0) return;
         }
     }
 
-    void remove_tags_in_paths(const std::vector<std::string>& paths_to_remove) {
-        std::lock_guard<std::mutex> lock(db_mutex);
-        std::vector<std::string> ids_to_remove;
-        for (const auto& [id, tag] : tags_by_id) {
-            for (const auto& bad_path : paths_to_remove) {
-                if (tag.file_path == bad_path || 
-                    (tag.file_path.size() > bad_path.size() && 
-                     tag.file_path.substr(0, bad_path.size()) == bad_path &&
-                     tag.file_path[bad_path.size()] == '/')) {
-                    ids_to_remove.push_back(id);
-                    break;
-                }
-            }
+public:
+    explicit ThreadPool(size_t threads) {
+        if (threads == 0) threads = 1;
+        for (size_t i = 0; i < threads; ++i) {
+            queues.push_back(std::make_unique<WorkerQueue>());
         }
-        for (const auto& id : ids_to_remove) {
-            remove_tag(id);
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([this, i] { worker_loop(i); });
         }
     }
 
-    std::vector<Tag> get_all_tags() const {
-        std::lock_guard<std::mutex> lock(db_mutex);
-        std::vector<Tag> result;
-        for (const auto& [_, tag] : tags_by_id) {
-            result.push_back(tag);
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            running = false;
+        }
+        wake_cv.notify_all();
+        for (auto& w : workers) {
+            if (w.joinable()) w.join();
         }
-        return result;
     }
 
-    std::set<std::string> get_tag_ids_in_file(const std::string& file_path) const {
-        std::lock_guard<std::mutex> lock(db_mutex);
-        auto it = file_to_ids.find(file_path);
-        if (it != file_to_ids.end()) {
-            return it->second;
+    size_t size() const { return workers.size(); }
+
+    void submit(std::function<void()> task) {
+        size_t index = (current_pool == this)
+            ? current_index
+            : next_queue++ % queues.size();
+        {
+            std::lock_guard<std::mutex> lock(queues[index]->mutex);
+            queues[index]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            queued++;
+        }
+        wake_cv.notify_one();
+    }
+
+    // Runs one queued task on the calling thread, if any.
+    bool run_one() {
+        std::function<void()> task;
+        size_t start = (current_pool == this) ? current_index : 0;
+        if (steal(start, task)) {
+            queued--;
+            run_task(task);
+            return true;
+        }
+        return false;
+    }
+
+    // Calls fn(i) for every i in [0, count). The caller takes part in the work,
+    // so this is safe to use from inside a pool task.
+    void parallel_for(size_t count, const std::function<void(size_t)>& fn) {
+        if (count == 0) return;
+
+        struct State {
+            std::atomic<size_t> next{0};
+            std::atomic<size_t> done{0};
+            std::mutex mutex;
+            std::condition_variable cv;
+        };
+        auto state = std::make_shared<State>();
+        size_t total = count;
+
+        auto drain = [state, total, &fn]() {
+            size_t i;
+            while ((i = state->next++) < total) {
+                try {
+                    fn(i);
+                } catch (...) {}
+                if (++state->done == total) {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    state->cv.notify_all();
+                }
+            }
+        };
+
+        size_t helpers = std::min(count - 1, size());
+        for (size_t i = 0; i < helpers; ++i) submit(drain);
+        drain();
+
+        while (state->done < total) {
+            if (run_one()) continue;
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->cv.wait_for(lock, std::chrono::milliseconds(5),
+                               [&] { return state->done >= total; });
         }
-        return {};
     }
 };
 
 // ======================
-// TagParser
+// EventLoop
 // ======================
 
-class TagParser {
+// One epoll loop for the whole daemon. A source is an fd with a read
+// callback, plus an optional tick that does timed work and returns its next
+// deadline; the loop sleeps until an fd is ready or the earliest deadline,
+// so it never wakes up while idle. wake() and stop() work from any thread.
+class EventLoop {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Tick = std::function<std::optional<Clock::time_point>(Clock::time_point now)>;
+
 private:
-    const std::set<std::string> tag_types = {
-        "NOTE", "TODO", "WARNING", "WARN", "FIXME", "FIX", "BUG"
+    struct Source {
+        int fd;
+        std::function<void()> on_readable;
+        Tick on_tick;
+        std::function<void()> on_writable;  // see set_writable
     };
 
-    std::string generate_id() const {
-        static std::random_device rd;
-        static std::mt19937 gen(rd());
-        static std::uniform_int_distribution<> dis(0, 15);
-        std::string id = "CT-";
-        for (int i = 0; i < 8; ++i) {
-            id += "0123456789ABCDEF"[dis(gen)];
+    int epoll_fd{-1};
+    int wake_fd{-1};
+    std::atomic<bool> running{false};
+    std::mutex sources_mutex;
+    std::unordered_map<int, std::shared_ptr<Source>> sources;  // by fd, or by a negative id for timers
+    int next_timer_id = -1;
+
+public:
+    EventLoop() {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd < 0 || wake_fd < 0) {
+            std::cerr << "[EventLoop] Failed to initialize epoll." << std::endl;
+            return;
         }
-        return id;
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
     }
 
-    bool is_tag_line(const std::string& line, std::string& tag_type, std::string& content) const {
-        for (const auto& type : tag_types) {
-            std::string pattern = type + ":";
-            size_t pos = line.find(pattern);
-            if (pos != std::string::npos) {
-                size_t double_slash = line.find("//");
-                size_t slash_star = line.find("/*");
-                size_t hash = line.find("#");
-                if ((double_slash != std::string::npos && double_slash <= pos) ||
-                    (slash_star != std::string::npos && slash_star <= pos) ||
-                    (hash != std::string::npos && hash <= pos)) {
-                    tag_type = type;
-                    content = line.substr(pos + pattern.length());
-                    content.erase(0, content.find_first_not_of(" \t"));
-                    return true;
-                }
-            }
+    ~EventLoop() {
+        if (wake_fd >= 0) close(wake_fd);
+        if (epoll_fd >= 0) close(epoll_fd);
+    }
+
+    // Registers fd (or, with fd < 0, a pure timer); returns the key to remove it with.
+    int add(int fd, std::function<void()> on_readable, Tick on_tick = nullptr) {
+        std::lock_guard<std::mutex> lock(sources_mutex);
+        int key = fd >= 0 ? fd : next_timer_id--;
+        sources[key] = std::make_shared<Source>(Source{fd, std::move(on_readable), std::move(on_tick), nullptr});
+        if (fd >= 0) {
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
         }
-        return false;
+        wake();
+        return key;
     }
 
-    bool has_codetag_id(const std::string& line) const {
-        size_t pos = 0;
-        while ((pos = line.find("[CT-", pos)) != std::string::npos) {
-            size_t end = line.find("]", pos);
-            if (end != std::string::npos && end > pos) {
-                std::string id_candidate = line.substr(pos, end - pos + 1);
-                if (id_candidate.length() == 12 && id_candidate[10] == ']') {
-                    bool valid = true;
-                    for (size_t i = 4; i < 10; i++) {
-                        char c = id_candidate[i];
-                        if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'))) {
-                            valid = false;
-                            break;
-                        }
-                    }
-                    if (valid) return true;
+    // Calls on_writable each time fd can take more output, until it is
+    // reset to null.
+    void set_writable(int fd, std::function<void()> on_writable) {
+        std::lock_guard<std::mutex> lock(sources_mutex);
+        auto it = sources.find(fd);
+        if (it == sources.end()) return;
+        // A copy, as run() may be holding the current one
+        auto source = std::make_shared<Source>(*it->second);
+        source->on_writable = std::move(on_writable);
+        epoll_event ev{};
+        ev.events = source->on_writable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        it->second = std::move(source);
+    }
+
+    void remove(int key) {
+        std::lock_guard<std::mutex> lock(sources_mutex);
+        auto it = sources.find(key);
+        if (it == sources.end()) return;
+        if (it->second->fd >= 0) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->second->fd, nullptr);
+        sources.erase(it);
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        ssize_t n = write(wake_fd, &one, sizeof(one));
+        (void)n;
+    }
+
+    void stop() {
+        running = false;
+        wake();
+    }
+
+    void run() {
+        running = true;
+        epoll_event events[64];
+        while (running) {
+            std::vector<std::shared_ptr<Source>> snapshot;
+            {
+                std::lock_guard<std::mutex> lock(sources_mutex);
+                for (const auto& [_, source] : sources) snapshot.push_back(source);
+            }
+
+            auto now = Clock::now();
+            std::optional<Clock::time_point> next;
+            for (const auto& source : snapshot) {
+                if (!source->on_tick) continue;
+                auto deadline = source->on_tick(now);
+                if (deadline && (!next || *deadline < *next)) next = deadline;
+            }
+
+            int timeout = -1;
+            if (next) {
+                auto ms = std::chrono::ceil<std::chrono::milliseconds>(*next - Clock::now()).count();
+                timeout = static_cast<int>(std::clamp<long long>(ms, 0, 60 * 60 * 1000));
+            }
+
+            int n = epoll_wait(epoll_fd, events, 64, timeout);
+            if (n < 0 && errno != EINTR) {
+                std::cerr << "[EventLoop] epoll_wait failed: " << std::strerror(errno) << std::endl;
+                return;
+            }
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == wake_fd) {
+                    uint64_t count;
+                    while (read(wake_fd, &count, sizeof(count)) > 0) {}
+                    continue;
+                }
+                std::shared_ptr<Source> source;
+                {
+                    std::lock_guard<std::mutex> lock(sources_mutex);
+                    auto it = sources.find(fd);
+                    if (it != sources.end()) source = it->second;
                 }
+                if (!source) continue;
+                if ((events[i].events & EPOLLOUT) && source->on_writable) source->on_writable();
+                if ((events[i].events & ~EPOLLOUT) && source->on_readable) source->on_readable();
             }
-            pos++;
         }
-        return false;
     }
+};
 
-    std::string extract_codetag_id(const std::string& line) const {
-        size_t pos = 0;
-        while ((pos = line.find("CT-", pos)) != std::string::npos) {
-            if (pos + 11 <= line.length() && (pos == 0 || !std::isalnum(line[pos-1]))) {
-                bool valid = true;
-                for (size_t i = pos + 3; i < pos + 11; i++) {
-                    char c = line[i];
-                    if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'))) {
-                        valid = false;
-                        break;
-                    }
-                }
-                if (valid && (pos + 11 >= line.length() || !std::isalnum(line[pos + 11]))) {
-                    return line.substr(pos, 11);  // "CT-" + 8 hex chars
-                }
+// ======================
+// Tag Struct
+// ======================
+
+// Tag type names, interned process-wide so each Tag carries a small number.
+// Repos can bring their own vocabulary (.ctagstypes), so this is a registry
+// rather than a fixed enum; names are never removed.
+class TagTypes {
+private:
+    static std::shared_mutex& types_mutex() {
+        static std::shared_mutex mutex;
+        return mutex;
+    }
+
+    static std::deque<std::string>& names() {
+        static std::deque<std::string> list;
+        return list;
+    }
+
+public:
+    static uint16_t intern(std::string_view name) {
+        {
+            std::shared_lock<std::shared_mutex> lock(types_mutex());
+            auto& list = names();
+            for (size_t i = 0; i < list.size(); ++i) {
+                if (list[i] == name) return static_cast<uint16_t>(i);
             }
-            pos++;
         }
-        return "";
+        std::unique_lock<std::shared_mutex> lock(types_mutex());
+        auto& list = names();
+        for (size_t i = 0; i < list.size(); ++i) {
+            if (list[i] == name) return static_cast<uint16_t>(i);
+        }
+        list.emplace_back(name);
+        return static_cast<uint16_t>(list.size() - 1);
     }
 
-    void add_codetag_id(std::string& line, const std::string& id) const {
-        if (!extract_codetag_id(line).empty()) {
-            return;  // Don't add if an ID already exists
+    static std::optional<uint16_t> find(std::string_view name) {
+        std::shared_lock<std::shared_mutex> lock(types_mutex());
+        auto& list = names();
+        for (size_t i = 0; i < list.size(); ++i) {
+            if (list[i] == name) return static_cast<uint16_t>(i);
         }
-        
-        for (const auto& type : tag_types) {
-            std::string pattern = type + ":";
-            size_t pos = line.find(pattern);
-            if (pos != std::string::npos) {
-                size_t content_start = pos + pattern.length();
-                line.insert(content_start, " " + id);
-                break;
-            }
+        return std::nullopt;
+    }
+
+    static std::string name(uint16_t type) {
+        std::shared_lock<std::shared_mutex> lock(types_mutex());
+        return type < names().size() ? names()[type] : std::string();
+    }
+};
+
+// A fixed-size record; the file's paths and mtime and the tag's text are
+// held once by the FileTags it belongs to.
+struct Tag {
+    uint32_t id = 0;              // the 8 hex digits of "CT-XXXXXXXX"
+    uint32_t line_number = 0;
+    uint32_t content_offset = 0;  // into FileTags::text
+    uint16_t content_length = 0;
+    uint16_t type = 0;            // TagTypes index
+
+    bool operator==(const Tag& other) const {
+        return id == other.id;
+    }
+
+    static std::string format_id(uint32_t id) {
+        char buf[12];
+        std::snprintf(buf, sizeof(buf), "CT-%08X", id);
+        return buf;
+    }
+
+    // Takes "CT-" plus exactly 8 upper-case hex digits.
+    static bool parse_id(std::string_view text, uint32_t& id) {
+        if (text.size() != 11 || text.substr(0, 3) != "CT-") return false;
+        id = 0;
+        for (char c : text.substr(3)) {
+            if (c >= '0' && c <= '9') id = id << 4 | static_cast<uint32_t>(c - '0');
+            else if (c >= 'A' && c <= 'F') id = id << 4 | static_cast<uint32_t>(c - 'A' + 10);
+            else return false;
         }
+        return true;
     }
+};
 
-    std::string get_file_relative_path(const std::string& file_path, const std::string& base_dir) const {
-        if (file_path.length() >= base_dir.length() &&
-            file_path.compare(0, base_dir.length(), base_dir) == 0) {
-            return file_path.substr(base_dir.length() + 1);
+// The tags of one file, with everything they share stored once: the path
+// (the relative path is a suffix of it), the mtime, and one buffer holding
+// every tag's text back to back.
+struct FileTags {
+    std::string file_path;
+    uint32_t relative_offset = 0;
+    time_t last_modified = 0;
+    std::string text;
+    std::vector<Tag> tags;
+
+    FileTags(std::string path, const std::string& base_dir, time_t mtime)
+        : file_path(std::move(path)), last_modified(mtime) {
+        if (file_path.size() > base_dir.size() && file_path.compare(0, base_dir.size(), base_dir) == 0 &&
+            file_path[base_dir.size()] == '/') {
+            relative_offset = static_cast<uint32_t>(base_dir.size() + 1);
         }
-        return file_path;
     }
 
-public:
-    std::vector<Tag> parse_file(const std::string& file_path, const std::string& base_dir, time_t mtime) {
-        std::vector<Tag> tags;
-        std::ifstream file(file_path);
-        if (!file.is_open()) return tags;
+    std::string_view relative_path() const {
+        return std::string_view(file_path).substr(relative_offset);
+    }
 
-        std::vector<std::string> lines;
-        std::string line;
-        while (std::getline(file, line)) lines.push_back(line);
-        file.close();
+    // The first component of the relative path; "" for files at the root.
+    std::string top_level_dir() const {
+        std::string_view rel = relative_path();
+        size_t slash = rel.find('/');
+        return slash == std::string_view::npos ? std::string() : std::string(rel.substr(0, slash));
+    }
 
-        bool modified = false;
-        for (auto& current_line : lines) {
-            std::string tag_type, content;
-            if (is_tag_line(current_line, tag_type, content) && !has_codetag_id(current_line)) {
-                std::string new_id = generate_id();
-                add_codetag_id(current_line, new_id);
-                modified = true;
-            }
+    std::string_view content(const Tag& tag) const {
+        return std::string_view(text).substr(tag.content_offset, tag.content_length);
+    }
+
+    void add(uint32_t id, uint16_t type, uint32_t line_number, std::string_view content) {
+        content = content.substr(0, UINT16_MAX);
+        tags.push_back(Tag{id, line_number, static_cast<uint32_t>(text.size()),
+                           static_cast<uint16_t>(content.size()), type});
+        text.append(content);
+    }
+
+    // Same tags under another path, e.g. after a rename.
+    FileTags moved_to(std::string path, const std::string& base_dir) const {
+        FileTags moved(std::move(path), base_dir, last_modified);
+        moved.text = text;
+        moved.tags = tags;
+        return moved;
+    }
+};
+
+struct ParsedFile {
+    std::string file_path;
+    std::shared_ptr<const FileTags> tags;  // null if the file has none
+    std::optional<FileStamp> stamp;        // nullopt if the file is gone
+    uint64_t content_hash = 0;             // 0 if unknown
+};
+
+namespace std {
+    template<> struct hash<Tag> {
+        size_t operator()(const Tag& t) const {
+            return hash<uint32_t>()(t.id);
         }
+    };
+}
 
-        if (modified) {
-            std::ofstream out(file_path);
-            for (const auto& l : lines) out << l << "\n";
-            out.close();
-            struct stat st;
-            if (stat(file_path.c_str(), &st) == 0) mtime = st.st_mtime;
-        }
-
-        int line_number = 0;
-        for (const auto& current_line : lines) {
-            line_number++;
-            std::string tag_type, content;
-            if (is_tag_line(current_line, tag_type, content)) {
-                Tag tag;
-                tag.type = tag_type;
-                tag.file_path = file_path;
-                tag.relative_path = get_file_relative_path(file_path, base_dir);
-                tag.line_number = line_number;
-                tag.last_modified = mtime;
-
-                std::string existing_id = extract_codetag_id(current_line);
-                if (!existing_id.empty()) {
-                    tag.id = existing_id;
-                    
-                    size_t tag_pos = current_line.find(tag_type + ":");
-                    if (tag_pos != std::string::npos) {
-                        size_t content_start = tag_pos + tag_type.length() + 1;
-                        std::string raw_content = current_line.substr(content_start);
-                        raw_content.erase(0, raw_content.find_first_not_of(" \t"));
-                        
-                        size_t id_pos = raw_content.find(existing_id);
-                        if (id_pos != std::string::npos) {
-                            tag.content = raw_content.substr(0, id_pos) + raw_content.substr(id_pos + existing_id.length());
-                            tag.content.erase(0, tag.content.find_first_not_of(" \t"));
-                        } else {
-                            tag.content = raw_content;
-                        }
-                    } else {
-                        tag.content = content;
+// ======================
+// IdIndex
+// ======================
+
+// Which file holds each tag ID of a repo, so an ID showing up in a second
+// file (a copy) is caught as it is parsed. Files are known by a hash of
+// their path. Sharded by ID, as the database is by path.
+class IdIndex {
+public:
+    using Owner = size_t;
+
+    static Owner owner_of(const std::string& file_path) {
+        return std::hash<std::string>()(file_path);
+    }
+
+    // Each thread draws from its own generator, so parsers never share one.
+    // Never 0, which stands for no ID.
+    static uint32_t random_id() {
+        static thread_local std::mt19937 gen(std::random_device{}());
+        uint32_t id = 0;
+        while (id == 0) id = static_cast<uint32_t>(gen());
+        return id;
+    }
+
+    // Takes id for owner unless another file holds it, which is then
+    // reported in holder.
+    bool claim(uint32_t id, Owner owner, Owner* holder = nullptr) {
+        Shard& shard = shard_of(id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto [it, added] = shard.owners.try_emplace(id, owner);
+        if (added || it->second == owner) return true;
+        if (holder) *holder = it->second;
+        return false;
+    }
+
+    void release(uint32_t id, Owner owner) {
+        Shard& shard = shard_of(id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.owners.find(id);
+        if (it != shard.owners.end() && it->second == owner) shard.owners.erase(it);
+    }
+
+    void transfer(uint32_t id, Owner from, Owner to) {
+        Shard& shard = shard_of(id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.owners.find(id);
+        if (it != shard.owners.end() && it->second == from) it->second = to;
+    }
+
+    // An ID no file holds, claimed for owner.
+    uint32_t allocate(Owner owner) {
+        while (true) {
+            uint32_t id = random_id();
+            if (claim(id, owner)) return id;
+        }
+    }
+
+    size_t size() {
+        size_t total = 0;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total += shard.owners.size();
+        }
+        return total;
+    }
+
+private:
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<uint32_t, Owner> owners;
+    };
+    std::array<Shard, 64> shards;
+
+    Shard& shard_of(uint32_t id) { return shards[id % shards.size()]; }
+};
+
+// ======================
+// TagDatabase
+// ======================
+
+// What an update did to one tag, worked out by comparing a file's old and new
+// tags by ID. The pointers are only valid during the listener call.
+struct TagChange {
+    enum Kind : uint8_t { ADDED, REMOVED, MOVED, CHANGED };
+    Kind kind;
+    const FileTags* file;                // where the tag is now; for REMOVED, where it was
+    const Tag* tag;
+    const FileTags* old_file = nullptr;  // MOVED and CHANGED: where it was before
+    const Tag* old_tag = nullptr;
+};
+
+// Each file's tags live in an immutable, reference-counted FileTags. Files are
+// spread over shards by path hash; a shard publishes a path-sorted list of
+// its entries that readers load without taking any lock, and a writer swaps
+// in a new list under that shard's mutex only, so parsers working on
+// different shards never contend and readers never block them. The new list
+// shares all but the chunks it changed with the old one (see FileList).
+class TagDatabase {
+public:
+    using FilePtr = std::shared_ptr<const FileTags>;
+    using ChangeListener = std::function<void(const std::vector<TagChange>&)>;
+
+    // A shard's files, sorted by path, in chunks that versions of the list
+    // share. A writer copies the chunk index and only the chunks it changes,
+    // so a commit costs O(files / chunk_size + chunk_size) per shard it
+    // touches, not a copy of the shard.
+    class FileList {
+    public:
+        using Chunk = std::vector<FilePtr>;        // sorted, never empty
+        static constexpr size_t chunk_size = 256;  // a chunk is split past twice this
+
+    private:
+        std::vector<std::shared_ptr<const Chunk>> chunks;
+        size_t count = 0;
+        friend class TagDatabase;
+
+        // The first chunk that holds path or a later one; chunks.size() if none.
+        size_t chunk_of(const std::string& path) const {
+            return std::lower_bound(chunks.begin(), chunks.end(), path,
+                                    [](const std::shared_ptr<const Chunk>& chunk, const std::string& p) {
+                                        return chunk->back()->file_path < p;
+                                    }) -
+                   chunks.begin();
+        }
+
+    public:
+        size_t size() const { return count; }
+
+        FilePtr find(const std::string& path) const {
+            size_t c = chunk_of(path);
+            if (c == chunks.size()) return nullptr;
+            auto it = find_in(*chunks[c], path);
+            return it != chunks[c]->end() && (*it)->file_path == path ? *it : nullptr;
+        }
+
+        template <typename Fn>
+        void for_each(Fn&& fn) const {
+            for (const auto& chunk : chunks) {
+                for (const auto& file : *chunk) fn(file);
+            }
+        }
+
+        // Visits the files from path on, in order, for as long as fn returns true.
+        template <typename Fn>
+        void visit_from(const std::string& path, Fn&& fn) const {
+            size_t first = chunk_of(path);
+            for (size_t c = first; c < chunks.size(); ++c) {
+                auto it = c == first ? find_in(*chunks[c], path) : chunks[c]->begin();
+                for (; it != chunks[c]->end(); ++it) {
+                    if (!fn(*it)) return;
+                }
+            }
+        }
+    };
+
+    // A point-in-time view of every shard. Holding one keeps its entries
+    // alive however the database changes in the meantime.
+    class Snapshot {
+    private:
+        std::vector<std::shared_ptr<const FileList>> shards;
+        friend class TagDatabase;
+
+    public:
+        template <typename Fn>
+        void for_each_file(Fn&& fn) const {
+            for (const auto& shard : shards) {
+                shard->for_each([&](const FilePtr& file) { fn(*file); });
+            }
+        }
+
+        // Visits the files whose path starts with prefix, e.g. "/repo/src/".
+        template <typename Fn>
+        void for_each_file_with_prefix(const std::string& prefix, Fn&& fn) const {
+            for (const auto& shard : shards) {
+                shard->visit_from(prefix, [&](const FilePtr& file) {
+                    if (file->file_path.compare(0, prefix.size(), prefix) != 0) return false;
+                    fn(*file);
+                    return true;
+                });
+            }
+        }
+
+        size_t tag_count() const {
+            size_t count = 0;
+            for_each_file([&](const FileTags& file) { count += file.tags.size(); });
+            return count;
+        }
+    };
+
+    static constexpr size_t shard_count = 64;
+
+    static size_t shard_of(const std::string& file_path) {
+        return std::hash<std::string>()(file_path) % shard_count;
+    }
+
+private:
+    struct Update {
+        std::string path;
+        FilePtr file;        // new tags, null to remove
+        FilePtr moved_from;  // set when the tags came from another path
+    };
+
+    struct Shard {
+        std::mutex write_mutex;
+        std::atomic<std::shared_ptr<const FileList>> files{std::make_shared<const FileList>()};
+    };
+
+    std::array<Shard, shard_count> shards;
+    std::mutex dirty_mutex;
+    std::set<uint16_t> dirty_types;  // types changed since the last render
+    std::set<std::string> dirty_dirs;  // top-level dirs whose tags changed, likewise
+    ChangeListener listener;
+    IdIndex id_index;
+
+    // Keeps the ID index in step: a file's IDs are let go with its tags and
+    // follow it when it is renamed. Parsers claim the IDs they keep or
+    // stamp; ADDED covers tags that came from elsewhere.
+    void track_ids(const std::vector<TagChange>& changes) {
+        const FileTags* file = nullptr;
+        IdIndex::Owner owner = 0;
+        for (const auto& change : changes) {
+            if (change.file != file) {
+                file = change.file;
+                owner = IdIndex::owner_of(file->file_path);
+            }
+            if (change.kind == TagChange::ADDED) {
+                id_index.claim(change.tag->id, owner);
+            } else if (change.kind == TagChange::REMOVED) {
+                id_index.release(change.tag->id, owner);
+            } else if (change.old_file->file_path != file->file_path) {
+                id_index.transfer(change.tag->id, IdIndex::owner_of(change.old_file->file_path), owner);
+            }
+        }
+    }
+
+    // Compares two versions of a file's tags by ID.
+    static void diff(const FilePtr& before, const FilePtr& after, std::vector<TagChange>& out) {
+        std::unordered_map<uint32_t, const Tag*> old_by_id;
+        if (before) {
+            for (const auto& tag : before->tags) old_by_id.emplace(tag.id, &tag);
+        }
+        if (after) {
+            for (const auto& tag : after->tags) {
+                auto it = old_by_id.find(tag.id);
+                if (it == old_by_id.end()) {
+                    out.push_back(TagChange{TagChange::ADDED, after.get(), &tag});
+                    continue;
+                }
+                const Tag* old = it->second;
+                old_by_id.erase(it);
+                if (old->type != tag.type || before->content(*old) != after->content(tag)) {
+                    out.push_back(TagChange{TagChange::CHANGED, after.get(), &tag, before.get(), old});
+                } else if (old->line_number != tag.line_number || before->file_path != after->file_path) {
+                    out.push_back(TagChange{TagChange::MOVED, after.get(), &tag, before.get(), old});
+                }
+            }
+        }
+        if (before && !old_by_id.empty()) {
+            for (const auto& tag : before->tags) {
+                auto it = old_by_id.find(tag.id);
+                if (it != old_by_id.end() && it->second == &tag) {
+                    out.push_back(TagChange{TagChange::REMOVED, before.get(), &tag});
+                }
+            }
+        }
+    }
+
+    void mark_dirty(const std::vector<TagChange>& changes) {
+        if (changes.empty()) return;
+        std::lock_guard<std::mutex> lock(dirty_mutex);
+        for (const auto& change : changes) {
+            dirty_types.insert(change.tag->type);
+            if (change.old_tag) dirty_types.insert(change.old_tag->type);
+            dirty_dirs.insert(change.file->top_level_dir());
+            if (change.old_file) dirty_dirs.insert(change.old_file->top_level_dir());
+        }
+    }
+
+    static FileList::Chunk::const_iterator find_in(const FileList::Chunk& chunk, const std::string& file_path) {
+        return std::lower_bound(chunk.begin(), chunk.end(), file_path,
+                                [](const FilePtr& file, const std::string& path) { return file->file_path < path; });
+    }
+
+    // A new version of a published FileList. Each chunk it changes is copied
+    // once; the rest stay shared with the version it started from.
+    class ListEditor {
+    private:
+        using Chunk = FileList::Chunk;
+        std::shared_ptr<FileList> list;
+        std::unordered_map<const Chunk*, std::shared_ptr<Chunk>> owned;  // copies made by this editor
+
+        Chunk& own(size_t c) {
+            auto it = owned.find(list->chunks[c].get());
+            if (it != owned.end()) return *it->second;
+            auto copy = std::make_shared<Chunk>(*list->chunks[c]);
+            owned.emplace(copy.get(), copy);
+            list->chunks[c] = copy;
+            return *copy;
+        }
+
+        // Drops chunk c if it emptied, or splits it if it grew too long.
+        void rebalance(size_t c) {
+            Chunk& chunk = own(c);
+            if (chunk.empty()) {
+                list->chunks.erase(list->chunks.begin() + c);
+            } else if (chunk.size() > 2 * FileList::chunk_size) {
+                auto tail = std::make_shared<Chunk>(chunk.begin() + chunk.size() / 2, chunk.end());
+                chunk.resize(chunk.size() / 2);
+                owned.emplace(tail.get(), tail);
+                list->chunks.insert(list->chunks.begin() + c + 1, tail);
+            }
+        }
+
+    public:
+        explicit ListEditor(const FileList& current) : list(std::make_shared<FileList>(current)) {}
+
+        FilePtr find(const std::string& path) const { return list->find(path); }
+
+        // Puts file at path, or with null removes what is there.
+        void set(const std::string& path, FilePtr file) {
+            size_t c = list->chunk_of(path);
+            if (c == list->chunks.size()) {
+                if (!file) return;
+                if (c == 0) {
+                    list->chunks.push_back(std::make_shared<const Chunk>(Chunk{std::move(file)}));
+                    list->count++;
+                    return;
+                }
+                --c;  // after every path: onto the end of the last chunk
+            }
+            Chunk& chunk = own(c);
+            auto it = chunk.begin() + (find_in(chunk, path) - chunk.cbegin());
+            bool present = it != chunk.end() && (*it)->file_path == path;
+            if (present && file) {
+                *it = std::move(file);
+                return;
+            }
+            if (present) {
+                chunk.erase(it);
+                list->count--;
+            } else if (file) {
+                chunk.insert(it, std::move(file));
+                list->count++;
+            } else {
+                return;
+            }
+            rebalance(c);
+        }
+
+        // Removes the files whose paths are in [from, to), appending them to
+        // removed. Chunks wholly inside the range are dropped without a copy.
+        void erase_range(const std::string& from, const std::string& to, std::vector<FilePtr>& removed) {
+            size_t c = list->chunk_of(from);
+            while (c < list->chunks.size()) {
+                const Chunk& chunk = *list->chunks[c];
+                size_t first = find_in(chunk, from) - chunk.begin();
+                size_t last = find_in(chunk, to) - chunk.begin();
+                bool ends_here = last < chunk.size();
+                removed.insert(removed.end(), chunk.begin() + first, chunk.begin() + last);
+                list->count -= last - first;
+                if (first == 0 && last == chunk.size()) {
+                    list->chunks.erase(list->chunks.begin() + c);
+                } else {
+                    if (first < last) {
+                        Chunk& copy = own(c);
+                        copy.erase(copy.begin() + first, copy.begin() + last);
                     }
+                    ++c;
+                }
+                if (ends_here) break;
+            }
+        }
+
+        std::shared_ptr<const FileList> done() { return std::move(list); }
+    };
+
+    void mark_dirty(const FilePtr& file) {
+        if (!file || file->tags.empty()) return;
+        std::lock_guard<std::mutex> lock(dirty_mutex);
+        for (const auto& tag : file->tags) dirty_types.insert(tag.type);
+        dirty_dirs.insert(file->top_level_dir());
+    }
+
+    // Applies one shard's share of a transaction. A file whose tags come out
+    // identical keeps its current entry.
+    void commit(size_t shard_index, std::vector<Update>& updates) {
+        Shard& shard = shards[shard_index];
+        std::lock_guard<std::mutex> lock(shard.write_mutex);
+        ListEditor list(*shard.files.load());
+        std::vector<TagChange> changes;
+        std::vector<FilePtr> replaced;  // keeps the old entries alive for the listener
+        bool modified = false;
+        for (auto& update : updates) {
+            FilePtr file = update.file && !update.file->tags.empty() ? update.file : nullptr;
+            FilePtr old = list.find(update.path);
+
+            size_t first_change = changes.size();
+            diff(update.moved_from ? update.moved_from : old, file, changes);
+            if (update.moved_from && old) {
+                diff(old, nullptr, changes);  // the tags the move overwrote
+            }
+            std::vector<TagChange> file_changes(changes.begin() + first_change, changes.end());
+            mark_dirty(file_changes);
+
+            bool retouched = old && file && old->last_modified != file->last_modified;
+            if (file_changes.empty() && !retouched && !update.moved_from) continue;
+            if (retouched) mark_dirty(file);  // its "Modified" time shows in every section
+
+            modified = true;
+            if (old) replaced.push_back(old);
+            if (update.moved_from) replaced.push_back(update.moved_from);
+            list.set(update.path, std::move(file));
+        }
+        if (!modified) return;
+        shard.files.store(list.done());
+        track_ids(changes);
+        if (listener && !changes.empty()) listener(changes);
+    }
+
+    void commit_all(std::vector<std::vector<Update>>& by_shard) {
+        for (size_t i = 0; i < shard_count; ++i) {
+            if (!by_shard[i].empty()) commit(i, by_shard[i]);
+        }
+    }
+
+    // Removes path and every file below it from one shard; returns the
+    // removed entries. The "path/..." files are one range, since '/' + 1 ==
+    // '0', so this costs a search plus the chunks the range touches.
+    std::vector<FilePtr> take_subtree(Shard& shard, const std::string& path, bool notify) {
+        std::lock_guard<std::mutex> lock(shard.write_mutex);
+        ListEditor list(*shard.files.load());
+        std::vector<FilePtr> removed;
+        if (FilePtr file = list.find(path)) {
+            removed.push_back(file);
+            list.set(path, nullptr);
+        }
+        list.erase_range(path + '/', path + char('/' + 1), removed);
+        if (removed.empty()) return removed;
+
+        std::vector<TagChange> changes;
+        for (const auto& file : removed) diff(file, nullptr, changes);
+        shard.files.store(list.done());
+        mark_dirty(changes);
+        if (!notify) return removed;  // a move: the IDs follow in the commit
+        track_ids(changes);
+        if (listener && !changes.empty()) listener(changes);
+        return removed;
+    }
+
+public:
+    // Called with the changes of every commit, under the lock of the shard
+    // committed to; install it before the first update.
+    void set_change_listener(ChangeListener on_change) {
+        listener = std::move(on_change);
+    }
+
+    IdIndex& ids() { return id_index; }
+
+    Snapshot snapshot() const {
+        Snapshot snap;
+        snap.shards.reserve(shard_count);
+        for (const auto& shard : shards) snap.shards.push_back(shard.files.load());
+        return snap;
+    }
+
+    void remove_tags_in_file(const std::string& file_path) {
+        replace_file_tags(file_path, nullptr);
+    }
+
+    // Swaps a file's old tags for its freshly parsed ones.
+    void replace_file_tags(const std::string& file_path, FilePtr tags) {
+        std::vector<Update> updates;
+        updates.push_back(Update{file_path, std::move(tags), nullptr});
+        commit(shard_of(file_path), updates);
+    }
+
+    // Merges a batch of parsed files, taking each shard's lock once.
+    void replace_files(const std::vector<ParsedFile>& batch) {
+        std::vector<std::vector<Update>> by_shard(shard_count);
+        for (const auto& parsed : batch) {
+            by_shard[shard_of(parsed.file_path)].push_back(Update{parsed.file_path, parsed.tags, nullptr});
+        }
+        commit_all(by_shard);
+    }
+
+    // Removes the tags of path and of every file below it; returns the files
+    // that had tags. Each shard costs a search, a copy of its chunk index if
+    // it holds any of them, and the chunks the subtree touches.
+    std::vector<std::string> remove_subtree(const std::string& path) {
+        std::vector<std::string> files;
+        for (auto& shard : shards) {
+            for (const auto& file : take_subtree(shard, path, true)) files.push_back(file->file_path);
+        }
+        return files;
+    }
+
+    void remove_tags_in_paths(const std::vector<std::string>& paths_to_remove) {
+        for (const auto& path : paths_to_remove) {
+            remove_subtree(path);
+        }
+    }
+
+    // Re-roots the tags of from (a file or a directory) under to, e.g. after
+    // a rename; returns the old paths of the files that moved.
+    std::vector<std::string> move_subtree(const std::string& from, const std::string& to,
+                                          const std::string& base_dir) {
+        std::vector<std::string> files;
+        std::vector<std::vector<Update>> by_shard(shard_count);
+        for (auto& shard : shards) {
+            // The removal is reported as part of the move, not on its own
+            for (const auto& file : take_subtree(shard, from, false)) {
+                std::string new_path = to + file->file_path.substr(from.size());
+                auto moved = std::make_shared<const FileTags>(file->moved_to(new_path, base_dir));
+                files.push_back(file->file_path);
+                by_shard[shard_of(new_path)].push_back(Update{std::move(new_path), std::move(moved), file});
+            }
+        }
+        commit_all(by_shard);
+        return files;
+    }
+
+    // Returns and clears the set of types whose tags changed.
+    std::set<uint16_t> take_dirty_types() {
+        std::lock_guard<std::mutex> lock(dirty_mutex);
+        return std::exchange(dirty_types, {});
+    }
+
+    // Returns and clears the set of top-level dirs whose tags changed.
+    std::set<std::string> take_dirty_dirs() {
+        std::lock_guard<std::mutex> lock(dirty_mutex);
+        return std::exchange(dirty_dirs, {});
+    }
+
+    FilePtr get_tags_in_file(const std::string& file_path) const {
+        return shards[shard_of(file_path)].files.load()->find(file_path);
+    }
+};
+
+// ======================
+// TagMatcher
+// ======================
+
+// Finds "TYPE:" keywords in a line. The vocabulary is compiled once into an
+// Aho-Corasick DFA over a reduced byte alphabet; memchr (vectorized in libc)
+// looks for ':' first, so lines without one never reach the automaton.
+class TagMatcher {
+public:
+    struct Match {
+        size_t type_index;
+        size_t pos;  // start of the keyword
+        size_t end;  // one past the ':'
+    };
+
+    static const std::vector<std::string>& default_types() {
+        static const std::vector<std::string> types = {
+            "NOTE", "TODO", "WARNING", "WARN", "FIXME", "FIX", "BUG"
+        };
+        return types;
+    }
+
+    static std::shared_ptr<const TagMatcher> defaults() {
+        static const auto matcher = std::make_shared<const TagMatcher>(default_types());
+        return matcher;
+    }
+
+    // Reads one tag type per line ('#' starts a comment); falls back to the
+    // built-in vocabulary if the file is missing or lists nothing usable.
+    static std::shared_ptr<const TagMatcher> load(const std::string& path) {
+        std::ifstream file(path);
+        if (!file.is_open()) return defaults();
+
+        std::vector<std::string> types;
+        std::string line;
+        while (std::getline(file, line)) {
+            size_t hash = line.find('#');
+            if (hash != std::string::npos) line.erase(hash);
+            size_t start = line.find_first_not_of(" \t\r");
+            if (start == std::string::npos) continue;
+            size_t end = line.find_last_not_of(" \t\r:");
+            std::string type = line.substr(start, end - start + 1);
+            bool valid = !type.empty();
+            for (char c : type) {
+                if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '-') valid = false;
+            }
+            if (valid && std::find(types.begin(), types.end(), type) == types.end()) {
+                types.push_back(type);
+            }
+        }
+        if (types.empty()) return defaults();
+        return std::make_shared<const TagMatcher>(std::move(types));
+    }
+
+    explicit TagMatcher(std::vector<std::string> vocabulary) : types(std::move(vocabulary)) {
+        for (const auto& type : types) type_ids.push_back(TagTypes::intern(type));
+        compile();
+    }
+
+    const std::vector<std::string>& tag_types() const { return types; }
+    const std::string& type_name(size_t index) const { return types[index]; }
+    uint16_t type_id(size_t index) const { return type_ids[index]; }
+
+    std::optional<size_t> type_index(std::string_view name) const {
+        for (size_t i = 0; i < types.size(); ++i) {
+            if (types[i] == name) return i;
+        }
+        return std::nullopt;
+    }
+
+    // Finds the first keyword that starts at a word boundary. The text is
+    // expected to be comment text: CommentLexer has done the rest.
+    bool find_keyword(std::string_view text, Match& match) const {
+        const char* data = text.data();
+        size_t size = text.size();
+
+        size_t from = 0;
+        while (from < size) {
+            const void* hit = std::memchr(data + from, ':', size - from);
+            if (!hit) return false;
+            size_t colon = static_cast<const char*>(hit) - data;
+            from = colon + 1;
+
+            // Every keyword ends in ':', so only the bytes just before it matter.
+            size_t window = colon >= max_keyword ? colon - max_keyword : 0;
+            int state = 0;
+            for (size_t i = window; i <= colon; ++i) {
+                state = transitions[state * class_count + byte_class[static_cast<unsigned char>(data[i])]];
+            }
+
+            for (int out = output[state]; out >= 0; out = output_link[out]) {
+                size_t len = types[out].size() + 1;
+                size_t pos = colon + 1 - len;
+                if (pos > 0) {
+                    unsigned char before = static_cast<unsigned char>(data[pos - 1]);
+                    if (std::isalnum(before) || before == '_') continue;
+                }
+                match = {static_cast<size_t>(out), pos, colon + 1};
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::vector<std::string> types;
+    std::vector<uint16_t> type_ids;  // TagTypes index of each type
+    std::array<uint8_t, 256> byte_class{};
+    size_t class_count = 1;
+    size_t max_keyword = 0;
+    std::vector<int> transitions;  // state * class_count + class -> state
+    std::vector<int> output;       // state -> longest keyword ending here, or -1
+    std::vector<int> output_link;  // keyword -> next shorter keyword that is a suffix, or -1
+
+    void compile() {
+        for (const auto& type : types) {
+            for (unsigned char c : type + ":") {
+                if (byte_class[c] == 0) byte_class[c] = static_cast<uint8_t>(class_count++);
+            }
+            max_keyword = std::max(max_keyword, type.size());
+        }
+
+        // Build the trie, then fill in failure transitions breadth-first.
+        std::vector<int> fail(1, 0);
+        transitions.assign(class_count, -1);
+        output.assign(1, -1);
+        for (size_t t = 0; t < types.size(); ++t) {
+            int state = 0;
+            for (unsigned char c : types[t] + ":") {
+                int& next = transitions[state * class_count + byte_class[c]];
+                if (next < 0) {
+                    next = static_cast<int>(output.size());
+                    transitions.resize(transitions.size() + class_count, -1);
+                    output.push_back(-1);
+                    fail.push_back(0);
+                }
+                state = transitions[state * class_count + byte_class[c]];
+            }
+            output[state] = static_cast<int>(t);
+        }
+
+        output_link.assign(types.size(), -1);
+        std::deque<int> queue;
+        for (size_t c = 0; c < class_count; ++c) {
+            int& next = transitions[c];
+            if (next < 0) {
+                next = 0;
+            } else {
+                fail[next] = 0;
+                queue.push_back(next);
+            }
+        }
+        while (!queue.empty()) {
+            int state = queue.front();
+            queue.pop_front();
+            int suffix_out = output[fail[state]];
+            if (output[state] < 0) {
+                output[state] = suffix_out;
+            } else {
+                output_link[output[state]] = suffix_out;
+            }
+            for (size_t c = 0; c < class_count; ++c) {
+                int& next = transitions[state * class_count + c];
+                int fallback = transitions[fail[state] * class_count + c];
+                if (next < 0) {
+                    next = fallback;
                 } else {
-                    tag.id = generate_id();
-                    tag.content = content;
+                    fail[next] = fallback;
+                    queue.push_back(next);
                 }
-                
-                tags.push_back(tag);
             }
         }
-        return tags;
+    }
+};
+
+// ======================
+// CommentLexer
+// ======================
+
+enum class CommentStyle : uint8_t { NONE, C, JS, GO, PHP, PYTHON, RUBY };
+
+// Source extensions and their comment style, looked up through a perfect
+// hash: each extension has a slot of its own (checked at compile time), so a
+// lookup is one hash and one compare.
+class SourceTypes {
+private:
+    struct Entry {
+        std::string_view ext;
+        CommentStyle style = CommentStyle::NONE;
+    };
+
+    static constexpr std::array<Entry, 12> entries = {{
+        {".c", CommentStyle::C},     {".h", CommentStyle::C},      {".cpp", CommentStyle::C},
+        {".hpp", CommentStyle::C},   {".java", CommentStyle::C},   {".rs", CommentStyle::C},
+        {".js", CommentStyle::JS},   {".ts", CommentStyle::JS},    {".go", CommentStyle::GO},
+        {".php", CommentStyle::PHP}, {".py", CommentStyle::PYTHON}, {".rb", CommentStyle::RUBY},
+    }};
+    static constexpr size_t slot_count = 32;
+
+    static constexpr size_t slot(std::string_view ext) {
+        return (ext.size() + static_cast<unsigned char>(ext[1]) * 5 + static_cast<unsigned char>(ext.back())) %
+               slot_count;
+    }
+
+    static constexpr std::array<Entry, slot_count> build() {
+        std::array<Entry, slot_count> table{};
+        for (const auto& entry : entries) table[slot(entry.ext)] = entry;
+        return table;
+    }
+
+    static constexpr bool collision_free() {
+        auto table = build();
+        for (const auto& entry : entries) {
+            if (table[slot(entry.ext)].ext != entry.ext) return false;
+        }
+        return true;
+    }
+
+public:
+    // ext includes the dot, e.g. ".cpp"; NONE if it isn't a source file.
+    static CommentStyle of(std::string_view ext) {
+        static_assert(collision_free(), "two source extensions share a slot; change SourceTypes::slot");
+        static constexpr auto table = build();
+        if (ext.size() < 2) return CommentStyle::NONE;
+        const Entry& entry = table[slot(ext)];
+        return entry.ext == ext ? entry.style : CommentStyle::NONE;
+    }
+
+    static CommentStyle of_path(std::string_view path) {
+        size_t dot = path.rfind('.');
+        if (dot == std::string_view::npos || path.find('/', dot) != std::string_view::npos) return CommentStyle::NONE;
+        return of(path.substr(dot));
+    }
+};
+
+// What a family of languages calls a comment or a string. CommentLexer is
+// instantiated per family, so none of this is looked at while scanning.
+enum class Backticks : uint8_t { NONE, TEMPLATE, RAW };  // `...` with escapes (JS) or without (Go)
+
+struct CLikeStyle {  // C, C++, Java, Rust
+    static constexpr bool slash_comments = true;    // "//" and "/* */"
+    static constexpr bool hash_comments = false;    // "#" to the end of the line
+    static constexpr bool hash_attributes = false;  // ... except "#[", which is code (PHP 8)
+    static constexpr bool char_literals = true;     // 'x' holds one char; a lone ' is a Rust lifetime
+    static constexpr bool raw_strings = true;       // C++ R"delim(...)delim"
+    static constexpr Backticks backticks = Backticks::NONE;
+    static constexpr bool triple_quotes = false;    // Python docstrings, scanned as comments
+    static constexpr bool begin_end = false;        // Ruby =begin ... =end
+};
+
+struct JsStyle : CLikeStyle {
+    static constexpr bool char_literals = false;
+    static constexpr bool raw_strings = false;
+    static constexpr Backticks backticks = Backticks::TEMPLATE;
+};
+
+struct GoStyle : CLikeStyle {
+    static constexpr bool raw_strings = false;
+    static constexpr Backticks backticks = Backticks::RAW;
+};
+
+struct PhpStyle : JsStyle {
+    static constexpr bool hash_comments = true;
+    static constexpr bool hash_attributes = true;
+};
+
+struct HashStyle {  // "#" comments only
+    static constexpr bool slash_comments = false;
+    static constexpr bool hash_comments = true;
+    static constexpr bool hash_attributes = false;
+    static constexpr bool char_literals = false;
+    static constexpr bool raw_strings = false;
+    static constexpr Backticks backticks = Backticks::NONE;
+    static constexpr bool triple_quotes = false;
+    static constexpr bool begin_end = false;
+};
+
+struct PythonStyle : HashStyle {
+    static constexpr bool triple_quotes = true;
+};
+
+struct RubyStyle : HashStyle {
+    static constexpr bool begin_end = true;
+};
+
+// Where a chunk of a file ended: in code, or in a comment or string that
+// goes on in the next chunk.
+struct LexerState {
+    enum Region : uint8_t { CODE, BLOCK, BEGIN_END, BACKTICK, TRIPLE, RAW } region = CODE;
+    char quote = 0;         // TRIPLE: ' or "
+    std::string raw_close;  // RAW: )delim"
+};
+
+// Finds the comments of a file in one pass. Code bytes cost a table lookup
+// each; string literals are stepped over, so "//" or "#" inside them opens
+// nothing. on_comment(begin, end) gets the offsets of each comment's text,
+// markers excluded. A file can be fed in chunks that end at a line break.
+template <typename Style>
+class CommentLexer {
+private:
+    static constexpr std::array<bool, 256> opens = [] {
+        std::array<bool, 256> table{};
+        table['"'] = table['\''] = true;
+        if (Style::slash_comments) table['/'] = true;
+        if (Style::hash_comments) table['#'] = true;
+        if (Style::backticks != Backticks::NONE) table['`'] = true;
+        if (Style::begin_end) table['='] = true;
+        return table;
+    }();
+
+    static size_t line_end(const char* data, size_t from, size_t size) {
+        const void* nl = std::memchr(data + from, '\n', size - from);
+        return nl ? static_cast<const char*>(nl) - data : size;
+    }
+
+    static size_t find(const char* data, size_t from, size_t size, std::string_view needle) {
+        if (from >= size) return size;
+        const void* hit = memmem(data + from, size - from, needle.data(), needle.size());
+        return hit ? static_cast<const char*>(hit) - data : size;
+    }
+
+    // Returns the offset past the one-line string opened at i. An unclosed
+    // string ends with its line, so a stray quote can't hide the rest of the
+    // file.
+    static size_t skip_string(const char* data, size_t i, size_t size) {
+        char quote = data[i];
+        for (size_t j = i + 1; j < size; ++j) {
+            char c = data[j];
+            if (c == '\\') {
+                ++j;
+            } else if (c == quote) {
+                return j + 1;
+            } else if (c == '\n') {
+                return j;
+            }
+        }
+        return size;
+    }
+
+    // Scans the region the state is in from `from`. Returns where code
+    // starts again, or size if the region goes on past this chunk.
+    template <typename Fn>
+    static size_t resume(const char* data, size_t from, size_t size, LexerState& state, Fn& on_comment) {
+        switch (state.region) {
+        case LexerState::CODE:
+            return from;
+        case LexerState::BLOCK: {
+            size_t end = find(data, from, size, "*/");
+            on_comment(from, end);
+            if (end == size) return size;
+            state.region = LexerState::CODE;
+            return end + 2;
+        }
+        case LexerState::BEGIN_END: {
+            // =end has to start a line
+            bool line_start = from == 0 || data[from - 1] == '\n';
+            size_t end = line_start && std::string_view(data + from, size - from).starts_with("=end")
+                             ? from
+                             : std::min(find(data, from, size, "\n=end") + 1, size);
+            on_comment(from, end);
+            if (end == size) return size;
+            state.region = LexerState::CODE;
+            return line_end(data, end, size);
+        }
+        case LexerState::BACKTICK:
+            for (size_t j = from; j < size; ++j) {
+                if (data[j] == '\\' && Style::backticks == Backticks::TEMPLATE) {
+                    ++j;
+                } else if (data[j] == '`') {
+                    state.region = LexerState::CODE;
+                    return j + 1;
+                }
+            }
+            return size;
+        case LexerState::TRIPLE: {
+            char quote = state.quote;
+            size_t end = from;
+            while (end + 2 < size && !(data[end] == quote && data[end + 1] == quote && data[end + 2] == quote)) {
+                end += data[end] == '\\' ? 2 : 1;
+            }
+            end = end + 2 < size ? end : size;
+            on_comment(from, end);
+            if (end == size) return size;
+            state.region = LexerState::CODE;
+            return end + 3;
+        }
+        case LexerState::RAW: {
+            size_t end = find(data, from, size, state.raw_close);
+            if (end == size) return size;
+            state.region = LexerState::CODE;
+            return end + state.raw_close.size();
+        }
+        }
+        return size;
+    }
+
+public:
+    template <typename Fn>
+    static void scan(const char* data, size_t size, LexerState& state, Fn&& on_comment) {
+        size_t i = resume(data, 0, size, state, on_comment);
+        while (i < size) {
+            while (i < size && !opens[static_cast<unsigned char>(data[i])]) ++i;
+            if (i >= size) return;
+            char c = data[i];
+            char next = i + 1 < size ? data[i + 1] : '\0';
+
+            if (c == '/') {
+                if (next == '/') {
+                    size_t end = line_end(data, i + 2, size);
+                    on_comment(i + 2, end);
+                    i = end;
+                } else if (next == '*') {
+                    state.region = LexerState::BLOCK;
+                    i = resume(data, i + 2, size, state, on_comment);
+                } else {
+                    ++i;
+                }
+            } else if (c == '#') {
+                if (Style::hash_attributes && next == '[') {
+                    ++i;
+                    continue;
+                }
+                size_t end = line_end(data, i + 1, size);
+                on_comment(i + 1, end);
+                i = end;
+            } else if (c == '=') {
+                // =begin only counts at the start of a line
+                std::string_view rest(data + i, size - i);
+                if ((i == 0 || data[i - 1] == '\n') && rest.starts_with("=begin") &&
+                    (rest.size() == 6 || std::isspace(static_cast<unsigned char>(rest[6])))) {
+                    state.region = LexerState::BEGIN_END;
+                    i = resume(data, i + 6, size, state, on_comment);
+                } else {
+                    ++i;
+                }
+            } else if (c == '`') {
+                state.region = LexerState::BACKTICK;
+                i = resume(data, i + 1, size, state, on_comment);
+            } else if (Style::triple_quotes && next == c && i + 2 < size && data[i + 2] == c) {
+                state.region = LexerState::TRIPLE;
+                state.quote = c;
+                i = resume(data, i + 3, size, state, on_comment);
+            } else if (Style::char_literals && c == '\'') {
+                if (next == '\\') {
+                    i = skip_string(data, i, size);
+                } else if (i + 2 < size && data[i + 2] == '\'') {
+                    i += 3;
+                } else {
+                    ++i;  // a lifetime, or an apostrophe in code we don't understand
+                }
+            } else if (Style::raw_strings && c == '"' && i > 0 && data[i - 1] == 'R') {
+                // R"delim(...)delim", the delimiter being at most 16 chars
+                size_t open = i + 1;
+                while (open < size && open - i <= 17 && data[open] != '(' && data[open] != '"' &&
+                       data[open] != '\n') {
+                    ++open;
+                }
+                if (open < size && data[open] == '(') {
+                    state.region = LexerState::RAW;
+                    state.raw_close = ")" + std::string(data + i + 1, open - i - 1) + "\"";
+                    i = resume(data, open + 1, size, state, on_comment);
+                } else {
+                    i = skip_string(data, i, size);
+                }
+            } else {
+                i = skip_string(data, i, size);
+            }
+        }
+    }
+
+    // A whole file at once.
+    template <typename Fn>
+    static void scan(const char* data, size_t size, Fn&& on_comment) {
+        LexerState state;
+        scan(data, size, state, on_comment);
+    }
+};
+
+// ======================
+// TagParser
+// ======================
+
+class TagParser {
+private:
+    std::shared_ptr<const TagMatcher> matcher;
+    IdIndex* ids;                                              // null: IDs aren't checked for duplicates
+    const std::unordered_set<IdIndex::Owner>* deferred = nullptr;  // see defer_conflicts_with
+    bool defer_all = false;                                    // see defer_all_conflicts
+    bool stamping = true;                                      // see read_only
+
+    std::string_view extract_codetag_id(std::string_view line) const {
+        size_t pos = 0;
+        while ((pos = line.find("CT-", pos)) != std::string_view::npos) {
+            if (pos + 11 <= line.length() && (pos == 0 || !std::isalnum(static_cast<unsigned char>(line[pos-1])))) {
+                bool valid = true;
+                for (size_t i = pos + 3; i < pos + 11; i++) {
+                    char c = line[i];
+                    if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'))) {
+                        valid = false;
+                        break;
+                    }
+                }
+                if (valid && (pos + 11 >= line.length() || !std::isalnum(static_cast<unsigned char>(line[pos + 11])))) {
+                    return line.substr(pos, 11);  // "CT-" + 8 hex chars
+                }
+            }
+            pos++;
+        }
+        return {};
+    }
+
+    static std::string_view trim_leading(std::string_view text) {
+        size_t start = text.find_first_not_of(" \t");
+        return start == std::string_view::npos ? std::string_view{} : text.substr(start);
+    }
+
+public:
+    struct ParseInfo {
+        enum Skipped : uint8_t { NONE, TOO_LARGE, BINARY } skipped = NONE;  // if so, nothing was parsed
+        std::optional<FileStamp> written;  // set if IDs were stamped into the file
+        uint64_t content_hash = 0;         // hash of the contents as read
+        uint64_t size = 0;                 // bytes read
+        uint32_t long_lines = 0;           // lines skipped for being over the limit
+        uint32_t restamped = 0;            // IDs replaced for being duplicates
+        bool contested = false;            // kept an ID a deferred file holds
+    };
+
+private:
+    static constexpr size_t binary_sniff = 8000;  // a NUL in this many leading bytes means binary, as in git
+
+    ScanLimits limits;
+
+    // A change to make to the file: erase bytes at offset, then insert text,
+    // which is the new ID id.
+    struct Edit {
+        uint64_t offset;
+        size_t erase;
+        std::string text;
+        uint32_t id;
+    };
+
+    // Whether a tag may keep its ID: the file hasn't used it already and no
+    // other file holds it, unless that file is one of the deferred.
+    bool keep_id(uint32_t id, IdIndex::Owner owner, std::unordered_set<uint32_t>& seen, bool& contested) {
+        if (!seen.insert(id).second) return false;
+        if (!ids) return true;
+        IdIndex::Owner holder;
+        if (ids->claim(id, owner, &holder)) return true;
+        if (defer_all || (deferred && deferred->count(holder))) {
+            contested = true;
+            return true;
+        }
+        return false;
+    }
+
+    uint32_t new_id(IdIndex::Owner owner) {
+        return ids ? ids->allocate(owner) : IdIndex::random_id();
+    }
+
+    // Reads the file in chunks of whole lines through one buffer per thread,
+    // max_line_length long, so memory doesn't depend on the file. A line
+    // that doesn't fit is skipped. Returns false if the file couldn't be
+    // read or is skipped.
+    template <typename Style>
+    bool scan(int fd, const std::string& file_path, const std::string& base_dir, time_t mtime,
+              std::optional<FileTags>& tags, std::vector<Edit>& edits, ParseInfo& info) {
+        std::vector<char>& buffer = Utils::thread_buffer();
+        buffer.resize(limits.max_line_length + 1);  // the line and its newline
+        char* data = buffer.data();
+        ContentHasher hasher;
+        LexerState state;
+        std::string content;
+        IdIndex::Owner owner = IdIndex::owner_of(file_path);
+        std::unordered_set<uint32_t> seen;
+
+        int line_number = 1;     // of data[counted]
+        size_t counted = 0;
+        uint64_t base = 0;       // file offset of data[0]
+        size_t filled = 0;
+        bool skipping = false;  // in a line over the limit
+
+        // Within a comment, jump from colon to colon; newlines are only
+        // counted up to the lines that match.
+        auto on_comment = [&](size_t begin, size_t end) {
+            size_t from = begin;
+            while (from < end) {
+                const void* colon = std::memchr(data + from, ':', end - from);
+                if (!colon) return;
+                size_t colon_pos = static_cast<const char*>(colon) - data;
+
+                const void* prev_nl = memrchr(data + from, '\n', colon_pos - from);
+                size_t line_start = prev_nl ? static_cast<const char*>(prev_nl) - data + 1 : from;
+                const void* next_nl = std::memchr(data + colon_pos, '\n', end - colon_pos);
+                size_t line_end = next_nl ? static_cast<const char*>(next_nl) - data : end;
+                std::string_view line(data + line_start, line_end - line_start);
+                while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) {
+                    line.remove_suffix(1);
+                }
+                from = line_end + 1;
+
+                TagMatcher::Match match;
+                if (!matcher->find_keyword(line, match)) continue;
+                line_number += static_cast<int>(std::count(data + counted, data + line_start, '\n'));
+                counted = line_start;
+                if (!tags) tags.emplace(file_path, base_dir, mtime);
+
+                uint32_t id;
+                std::string_view raw_content = trim_leading(line.substr(match.end));
+                std::string_view existing_id = extract_codetag_id(line);
+                if (!existing_id.empty() && Tag::parse_id(existing_id, id)) {
+                    size_t id_pos = raw_content.find(existing_id);
+                    if (id_pos != std::string_view::npos) {
+                        content = raw_content.substr(0, id_pos);
+                        content += raw_content.substr(id_pos + existing_id.length());
+                        content.erase(0, content.find_first_not_of(" \t"));
+                    } else {
+                        content = raw_content;
+                    }
+                    if (!keep_id(id, owner, seen, info.contested) && stamping) {
+                        id = new_id(owner);
+                        seen.insert(id);
+                        edits.push_back(
+                            Edit{base + (existing_id.data() - data), existing_id.size(), Tag::format_id(id), id});
+                        info.restamped++;
+                    }
+                } else if (!stamping) {
+                    id = 0;
+                    content = raw_content;
+                } else {
+                    id = new_id(owner);
+                    seen.insert(id);
+                    content = raw_content;
+                    edits.push_back(Edit{base + line_start + match.end, 0, " " + Tag::format_id(id), id});
+                }
+                tags->add(id, matcher->type_id(match.type_index), static_cast<uint32_t>(line_number), content);
+            }
+        };
+
+        bool eof = false;
+        while (!eof) {
+            // Fill the buffer, so a file that fits is lexed in one go
+            while (filled < buffer.size()) {
+                ssize_t n = Utils::read_some(fd, data + filled, buffer.size() - filled);
+                if (n < 0) return false;
+                if (n == 0) {
+                    eof = true;
+                    break;
+                }
+                if (info.size < binary_sniff &&
+                    std::memchr(data + filled, '\0', std::min<uint64_t>(n, binary_sniff - info.size))) {
+                    info.skipped = ParseInfo::BINARY;
+                    return false;
+                }
+                hasher.update(data + filled, n);
+                info.size += n;
+                if (info.size > limits.max_file_size) {  // it grew since it was stat'ed
+                    info.skipped = ParseInfo::TOO_LARGE;
+                    return false;
+                }
+                filled += n;
+            }
+
+            if (skipping) {
+                const void* nl = std::memchr(data, '\n', filled);
+                size_t dropped = nl ? static_cast<const char*>(nl) - data + 1 : filled;
+                base += dropped;
+                filled -= dropped;
+                std::memmove(data, data + dropped, filled);
+                if (!nl) continue;
+                line_number++;
+                skipping = false;
+            }
+
+            // Whole lines only, so nothing but a multi-line comment or
+            // string is cut, and the lexer state carries that over
+            size_t chunk = filled;
+            if (!eof) {
+                const void* last_nl = memrchr(data, '\n', filled);
+                if (!last_nl) {
+                    info.long_lines++;
+                    skipping = true;
+                    base += filled;
+                    filled = 0;
+                    continue;
+                }
+                chunk = static_cast<const char*>(last_nl) - data + 1;
+            }
+            counted = 0;
+            CommentLexer<Style>::scan(data, chunk, state, on_comment);
+            if (eof) break;
+            line_number += static_cast<int>(std::count(data + counted, data + chunk, '\n'));
+            base += chunk;
+            filled -= chunk;
+            std::memmove(data, data + chunk, filled);
+        }
+        info.content_hash = hasher.digest();
+        return true;
+    }
+
+public:
+    explicit TagParser(std::shared_ptr<const TagMatcher> tag_matcher = TagMatcher::defaults(),
+                       ScanLimits scan_limits = {}, IdIndex* id_index = nullptr)
+        : matcher(std::move(tag_matcher)), ids(id_index), limits(scan_limits) {}
+
+    // An ID held by one of these files is kept, and the tag reported as
+    // contested, rather than replaced: the files are being parsed too, and
+    // one of them may be giving the ID up (a tag moved between files).
+    void defer_conflicts_with(const std::unordered_set<IdIndex::Owner>* owners) { deferred = owners; }
+
+    // The same for every holder, when all the files holding IDs are being
+    // parsed, as in a one-shot scan.
+    void defer_all_conflicts() { defer_all = true; }
+
+    // Never write to files: a tag without an ID is reported with ID 0, and
+    // duplicate IDs are left as they are.
+    void read_only() { stamping = false; }
+
+    // Claims the IDs of tags that weren't parsed (reused from the index).
+    // False if one of them has to be replaced, which takes a parse.
+    bool claim_ids(const FileTags& file, bool& contested) {
+        IdIndex::Owner owner = IdIndex::owner_of(file.file_path);
+        std::unordered_set<uint32_t> seen;
+        for (const auto& tag : file.tags) {
+            if (!keep_id(tag.id, owner, seen, contested)) return false;
+        }
+        return true;
+    }
+
+    // Tags without an ID get one, as do tags whose ID another tag has, and
+    // the file is rewritten to hold them. Returns null if the file holds no
+    // tags or was skipped.
+    std::shared_ptr<const FileTags> parse_file(const std::string& file_path, const std::string& base_dir,
+                                               time_t mtime, ParseInfo* info = nullptr) {
+        ParseInfo unused;
+        if (!info) info = &unused;
+        int fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return nullptr;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return nullptr;
+        }
+        if (static_cast<uint64_t>(st.st_size) > limits.max_file_size) {
+            info->skipped = ParseInfo::TOO_LARGE;
+            close(fd);
+            return nullptr;
+        }
+
+        std::optional<FileTags> tags;
+        std::vector<Edit> edits;
+        bool ok = false;
+        switch (SourceTypes::of_path(file_path)) {
+        case CommentStyle::JS: ok = scan<JsStyle>(fd, file_path, base_dir, mtime, tags, edits, *info); break;
+        case CommentStyle::GO: ok = scan<GoStyle>(fd, file_path, base_dir, mtime, tags, edits, *info); break;
+        case CommentStyle::PHP: ok = scan<PhpStyle>(fd, file_path, base_dir, mtime, tags, edits, *info); break;
+        case CommentStyle::PYTHON:
+            ok = scan<PythonStyle>(fd, file_path, base_dir, mtime, tags, edits, *info);
+            break;
+        case CommentStyle::RUBY: ok = scan<RubyStyle>(fd, file_path, base_dir, mtime, tags, edits, *info); break;
+        default: ok = scan<CLikeStyle>(fd, file_path, base_dir, mtime, tags, edits, *info); break;
+        }
+        if (!ok) {
+            close(fd);
+            return nullptr;
+        }
+
+        if (!edits.empty()) {
+            // Copied from the descriptor we read, chunk by chunk, in case
+            // the file has been replaced since. If it has been, or written
+            // to (an editor saving), the rewrite is dropped rather than
+            // lose that save; its event has the file parsed again.
+            FileStamp read_stamp = FileStamp::from_stat(st);
+            std::vector<char>& buffer = Utils::thread_buffer();
+            bool written = Utils::write_file_atomic(file_path, [&](std::ostream& out) {
+                uint64_t copied = 0;
+                auto copy_to = [&](uint64_t offset) {
+                    while (copied < offset && out) {
+                        ssize_t n = pread(fd, buffer.data(), std::min<uint64_t>(buffer.size(), offset - copied),
+                                          static_cast<off_t>(copied));
+                        if (n <= 0) {
+                            out.setstate(std::ios::failbit);
+                            return;
+                        }
+                        out.write(buffer.data(), n);
+                        copied += n;
+                    }
+                };
+                for (const auto& edit : edits) {
+                    copy_to(edit.offset);
+                    out << edit.text;
+                    copied += edit.erase;
+                }
+                copy_to(info->size);
+            }, [&] {
+                auto current = FileStamp::of(file_path);
+                return current && *current == read_stamp;
+            });
+            if (!written && ids) {
+                // The new IDs aren't in the file; the next parse claims its own
+                IdIndex::Owner owner = IdIndex::owner_of(file_path);
+                for (const auto& edit : edits) ids->release(edit.id, owner);
+            }
+            if (written && stat(file_path.c_str(), &st) == 0) {
+                mtime = st.st_mtime;
+                info->written = FileStamp::from_stat(st);
+            }
+        }
+        close(fd);
+
+        if (!tags) return nullptr;
+        tags->last_modified = mtime;
+        tags->tags.shrink_to_fit();
+        tags->text.shrink_to_fit();
+        return std::make_shared<const FileTags>(std::move(*tags));
+    }
+
+    static bool is_source_file(const std::string& ext) {
+        return SourceTypes::of(ext) != CommentStyle::NONE;
+    }
+};
+
+// ======================
+// TagIndex
+// ======================
+
+// On-disk copy of a repo's parse results, so a restarted daemon only reparses
+// files that changed while it was down. The snapshot holds every file's stamp,
+// content hash and tags; later changes are appended to a journal until
+// compact() folds them into a fresh snapshot.
+class TagIndex {
+public:
+    struct Entry {
+        FileStamp stamp;
+        uint64_t content_hash = 0;
+        std::shared_ptr<const FileTags> tags;  // null if the file has none
+    };
+    using EntrySink = std::function<void(const std::string& file_path, const Entry& entry)>;
+
+    static constexpr size_t compact_after = 4096;  // journal records
+
+private:
+    std::string base_dir;
+    std::string snapshot_path;
+    std::string journal_path;
+    std::mutex index_mutex;
+    int journal_fd = -1;
+    size_t journal_records = 0;
+
+    static constexpr char magic[8] = {'C', 'T', 'I', 'D', 'X', '0', '0', '2'};
+    enum : uint8_t { OP_UPSERT = 1, OP_REMOVE = 2 };
+
+    struct Writer {
+        std::string buf;
+        template<typename T> void put(T value) {
+            buf.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+        void put_str(std::string_view str) {
+            put<uint32_t>(static_cast<uint32_t>(str.size()));
+            buf.append(str);
+        }
+    };
+
+    struct Reader {
+        const char* p;
+        const char* end;
+        bool ok = true;
+        template<typename T> T get() {
+            T value{};
+            if (static_cast<size_t>(end - p) < sizeof(T)) {
+                ok = false;
+                return value;
+            }
+            std::memcpy(&value, p, sizeof(T));
+            p += sizeof(T);
+            return value;
+        }
+        std::string get_str() {
+            uint32_t len = get<uint32_t>();
+            if (!ok || static_cast<size_t>(end - p) < len) {
+                ok = false;
+                return {};
+            }
+            std::string str(p, len);
+            p += len;
+            return str;
+        }
+    };
+
+    // Each record: u32 length, u8 op, relative path, then for upserts the
+    // stamp, hash, mtime and tags.
+    void encode(Writer& w, uint8_t op, const std::string& file_path, const Entry* entry) const {
+        size_t start = w.buf.size();
+        w.put<uint32_t>(0);
+        w.put<uint8_t>(op);
+        w.put_str(relative(file_path));
+        if (op == OP_UPSERT) {
+            w.put<uint64_t>(entry->stamp.inode);
+            w.put<int64_t>(entry->stamp.size);
+            w.put<int64_t>(entry->stamp.mtime_ns);
+            w.put<uint64_t>(entry->content_hash);
+            w.put<int64_t>(entry->tags ? entry->tags->last_modified : 0);
+            w.put<uint32_t>(entry->tags ? static_cast<uint32_t>(entry->tags->tags.size()) : 0);
+            if (entry->tags) {
+                for (const auto& tag : entry->tags->tags) {
+                    w.put<uint32_t>(tag.id);
+                    w.put<uint32_t>(tag.line_number);
+                    w.put_str(TagTypes::name(tag.type));
+                    w.put_str(entry->tags->content(tag));
+                }
+            }
+        }
+        uint32_t len = static_cast<uint32_t>(w.buf.size() - start - sizeof(uint32_t));
+        std::memcpy(&w.buf[start], &len, sizeof(len));
+    }
+
+    // Applies framed records to entries; a torn record at the end (from a
+    // crash mid-append) is ignored.
+    void decode(const char* data, size_t size, std::unordered_map<std::string, Entry>& entries) const {
+        Reader frame{data, data + size};
+        while (true) {
+            uint32_t len = frame.get<uint32_t>();
+            if (!frame.ok || static_cast<size_t>(frame.end - frame.p) < len) return;
+            Reader r{frame.p, frame.p + len};
+            frame.p += len;
+
+            uint8_t op = r.get<uint8_t>();
+            std::string rel = r.get_str();
+            if (!r.ok) return;
+            std::string file_path = base_dir + "/" + rel;
+            if (op == OP_REMOVE) {
+                entries.erase(file_path);
+                continue;
+            }
+
+            Entry entry;
+            entry.stamp.inode = static_cast<ino_t>(r.get<uint64_t>());
+            entry.stamp.size = static_cast<off_t>(r.get<int64_t>());
+            entry.stamp.mtime_ns = r.get<int64_t>();
+            entry.content_hash = r.get<uint64_t>();
+            FileTags tags(file_path, base_dir, static_cast<time_t>(r.get<int64_t>()));
+            uint32_t count = r.get<uint32_t>();
+            for (uint32_t i = 0; r.ok && i < count; ++i) {
+                uint32_t id = r.get<uint32_t>();
+                uint32_t line_number = r.get<uint32_t>();
+                uint16_t type = TagTypes::intern(r.get_str());
+                tags.add(id, type, line_number, r.get_str());
+            }
+            if (!r.ok) return;
+            if (count > 0) entry.tags = std::make_shared<const FileTags>(std::move(tags));
+            entries[file_path] = std::move(entry);
+        }
+    }
+
+    static bool map_file(const std::string& path, const std::function<void(const char*, size_t)>& fn) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return st.st_size == 0;
+        }
+        void* data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) return false;
+        madvise(data, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+        fn(static_cast<const char*>(data), static_cast<size_t>(st.st_size));
+        munmap(data, static_cast<size_t>(st.st_size));
+        return true;
+    }
+
+    std::string relative(const std::string& file_path) const {
+        if (file_path.size() > base_dir.size() && file_path.compare(0, base_dir.size(), base_dir) == 0 &&
+            file_path[base_dir.size()] == '/') {
+            return file_path.substr(base_dir.size() + 1);
+        }
+        return file_path;
+    }
+
+    void close_journal() {
+        if (journal_fd >= 0) {
+            close(journal_fd);
+            journal_fd = -1;
+        }
+    }
+
+public:
+    TagIndex(const std::string& index_dir, const std::string& repo_path) : base_dir(repo_path) {
+        std::string name = fs::path(repo_path).filename().string();
+        std::stringstream id;
+        id << std::hex << std::setw(16) << std::setfill('0') << Utils::hash_bytes(repo_path.data(), repo_path.size());
+        std::string stem = index_dir + "/" + name + "-" + id.str();
+        snapshot_path = stem + ".idx";
+        journal_path = stem + ".journal";
+        std::error_code ec;
+        fs::create_directories(index_dir, ec);
+    }
+
+    ~TagIndex() {
+        close_journal();
+    }
+
+    // Reads the snapshot and replays the journal on top of it.
+    std::unordered_map<std::string, Entry> load() {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        std::unordered_map<std::string, Entry> entries;
+        bool current = true;
+        map_file(snapshot_path, [&](const char* data, size_t size) {
+            current = size >= sizeof(magic) && std::memcmp(data, magic, sizeof(magic)) == 0;
+            if (current) decode(data + sizeof(magic), size - sizeof(magic), entries);
+        });
+        // A journal written against an older format is not ours to replay
+        if (current) {
+            map_file(journal_path, [&](const char* data, size_t size) {
+                decode(data, size, entries);
+            });
+        } else {
+            unlink(journal_path.c_str());
+        }
+        return entries;
+    }
+
+    // Journals a batch of parse results: upserts for files that exist,
+    // removals for files that are gone.
+    void append(const std::vector<ParsedFile>& batch) {
+        if (batch.empty()) return;
+        Writer w;
+        for (const auto& parsed : batch) {
+            if (parsed.stamp) {
+                Entry entry{*parsed.stamp, parsed.content_hash, parsed.tags};
+                encode(w, OP_UPSERT, parsed.file_path, &entry);
+            } else {
+                encode(w, OP_REMOVE, parsed.file_path, nullptr);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(index_mutex);
+        if (journal_fd < 0) {
+            journal_fd = open(journal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (journal_fd < 0) return;
+        }
+        const char* p = w.buf.data();
+        size_t left = w.buf.size();
+        while (left > 0) {
+            ssize_t n = write(journal_fd, p, left);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            p += n;
+            left -= static_cast<size_t>(n);
+        }
+        journal_records += batch.size();
+    }
+
+    bool needs_compaction() {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        return journal_records >= compact_after;
+    }
+
+    // Writes a new snapshot from the entries produce() hands to its sink,
+    // then empties the journal.
+    void compact(const std::function<void(const EntrySink&)>& produce) {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        bool written = Utils::write_file_atomic(snapshot_path, [&](std::ostream& out) {
+            out.write(magic, sizeof(magic));
+            Writer w;
+            produce([&](const std::string& file_path, const Entry& entry) {
+                encode(w, OP_UPSERT, file_path, &entry);
+                if (w.buf.size() >= (1 << 20)) {
+                    out.write(w.buf.data(), static_cast<std::streamsize>(w.buf.size()));
+                    w.buf.clear();
+                }
+            });
+            out.write(w.buf.data(), static_cast<std::streamsize>(w.buf.size()));
+        });
+        if (!written) return;
+        close_journal();
+        unlink(journal_path.c_str());
+        journal_records = 0;
+    }
+};
+
+// ======================
+// GitIndex
+// ======================
+
+// Reads the tracked files and their cached stat data straight from a
+// repository's .git/index (versions 2 to 4), without the git binary.
+class GitIndex {
+public:
+    struct Entry {
+        std::string path;  // relative to the work tree
+        int64_t mtime_ns = 0;
+        uint32_t size = 0;  // git keeps the low 32 bits of these two
+        uint32_t ino = 0;
+
+        // True if git's cached stat data describes the file we last saw.
+        bool matches(const FileStamp& stamp) const {
+            return mtime_ns == stamp.mtime_ns && size == static_cast<uint32_t>(stamp.size) &&
+                   ino == static_cast<uint32_t>(stamp.inode);
+        }
+    };
+
+private:
+    static uint32_t be32(const unsigned char* p) {
+        return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 |
+               static_cast<uint32_t>(p[2]) << 8 | p[3];
+    }
+
+public:
+    // Finds the git directory of a work tree: .git itself, or where a .git
+    // file (worktrees, submodules) points. Empty if there is none.
+    static std::string find_git_dir(const std::string& work_tree) {
+        std::string dot_git = work_tree + "/.git";
+        std::error_code ec;
+        if (fs::is_directory(dot_git, ec)) return dot_git;
+        std::ifstream file(dot_git);
+        std::string line;
+        if (!std::getline(file, line) || line.rfind("gitdir: ", 0) != 0) return "";
+        fs::path dir = line.substr(8);
+        if (dir.is_relative()) dir = fs::path(work_tree) / dir;
+        return fs::is_directory(dir, ec) ? dir.lexically_normal().string() : "";
+    }
+
+    // Lists the regular files in the index, each path once.
+    static bool read(const std::string& index_path, std::vector<Entry>& entries) {
+        entries.clear();
+        std::vector<char> buffer;
+        if (!Utils::read_file(index_path, buffer) || buffer.size() < 12) return false;
+        const auto* data = reinterpret_cast<const unsigned char*>(buffer.data());
+        const unsigned char* end = data + buffer.size();
+        if (std::memcmp(data, "DIRC", 4) != 0) return false;
+        uint32_t version = be32(data + 4);
+        uint32_t count = be32(data + 8);
+        if (version < 2 || version > 4) return false;
+
+        const unsigned char* p = data + 12;
+        std::string path;
+        for (uint32_t i = 0; i < count; ++i) {
+            const unsigned char* start = p;
+            if (end - p < 62) return false;
+            Entry entry;
+            entry.mtime_ns = static_cast<int64_t>(be32(p + 8)) * 1000000000LL + be32(p + 12);
+            entry.ino = be32(p + 20);
+            uint32_t mode = be32(p + 24);
+            entry.size = be32(p + 36);
+            uint16_t flags = static_cast<uint16_t>(p[60] << 8 | p[61]);
+            p += 62;
+            if (version >= 3 && (flags & 0x4000)) p += 2;  // extended flags
+
+            if (version == 4) {
+                // The path is the previous one minus a varint count of bytes,
+                // plus a NUL-terminated suffix
+                if (p >= end) return false;
+                size_t strip = *p & 127;
+                while (*p++ & 128) {
+                    if (p >= end) return false;
+                    strip = ((strip + 1) << 7) | (*p & 127);
+                }
+                if (strip > path.size()) return false;
+                path.resize(path.size() - strip);
+            } else {
+                path.clear();
+            }
+            const void* nul = std::memchr(p, 0, static_cast<size_t>(end - p));
+            if (!nul) return false;
+            path.append(reinterpret_cast<const char*>(p), static_cast<const unsigned char*>(nul) - p);
+            p = static_cast<const unsigned char*>(nul) + 1;
+            if (version < 4) {
+                // Entries are NUL-padded to a multiple of 8 bytes
+                size_t length = static_cast<size_t>(p - start);
+                p = start + ((length + 7) & ~static_cast<size_t>(7));
+            }
+
+            bool regular = (mode >> 12) == 010;  // not a symlink or submodule
+            if (regular && (entries.empty() || entries.back().path != path)) {
+                entry.path = path;
+                entries.push_back(std::move(entry));
+            }
+        }
+        return true;
+    }
+};
+
+// ======================
+// EventDebouncer
+// ======================
+
+// Collapses bursts of events per path: a path becomes ready once it has seen
+// no new event for the quiet window, however many events it got before that.
+class EventDebouncer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    std::chrono::milliseconds quiet;
+    std::unordered_map<std::string, Clock::time_point> last_event;
+    std::deque<std::pair<std::string, Clock::time_point>> order;  // may hold stale entries
+
+    void drop_stale() {
+        while (!order.empty()) {
+            auto it = last_event.find(order.front().first);
+            if (it != last_event.end() && it->second == order.front().second) return;
+            order.pop_front();
+        }
+    }
+
+public:
+    explicit EventDebouncer(std::chrono::milliseconds quiet_window) : quiet(quiet_window) {}
+
+    void add(const std::string& path, Clock::time_point now = Clock::now()) {
+        last_event[path] = now;
+        order.emplace_back(path, now);
+    }
+
+    bool empty() const { return last_event.empty(); }
+    size_t size() const { return last_event.size(); }
+
+    // Re-keys the pending paths at or below from to the same place under to,
+    // e.g. once that directory has been renamed.
+    void move_subtree(const std::string& from, const std::string& to, Clock::time_point now = Clock::now()) {
+        std::vector<std::string> moved;
+        for (const auto& [path, _] : last_event) {
+            if (Utils::in_subtree(path, from)) moved.push_back(path);
+        }
+        for (const auto& path : moved) {
+            last_event.erase(path);
+            add(to + path.substr(from.size()), now);
+        }
+    }
+
+    std::optional<Clock::time_point> next_deadline() {
+        drop_stale();
+        if (order.empty()) return std::nullopt;
+        return order.front().second + quiet;
+    }
+
+    // Removes and returns every path whose quiet window has passed.
+    std::vector<std::string> take_ready(Clock::time_point now = Clock::now()) {
+        std::vector<std::string> ready;
+        while (true) {
+            drop_stale();
+            if (order.empty() || order.front().second + quiet > now) break;
+            last_event.erase(order.front().first);
+            ready.push_back(std::move(order.front().first));
+            order.pop_front();
+        }
+        return ready;
+    }
+};
+
+// ======================
+// CodetagsRenderer
+// ======================
+
+// An ostream target that hashes what goes through it on its way to another,
+// or only hashes it if there is no other.
+class HashingStreambuf : public std::streambuf {
+private:
+    std::streambuf* next;
+    ContentHasher hasher;
+    uint64_t count = 0;
+    char buffer[8192];
+
+    bool drain() {
+        auto n = pptr() - pbase();
+        hasher.update(pbase(), n);
+        count += n;
+        bool ok = !next || next->sputn(pbase(), n) == n;
+        setp(buffer, buffer + sizeof(buffer));
+        return ok;
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (!drain()) return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override { return drain() ? 0 : -1; }
+
+public:
+    explicit HashingStreambuf(std::streambuf* forward_to = nullptr) : next(forward_to) {
+        setp(buffer, buffer + sizeof(buffer));
+    }
+
+    uint64_t digest() {
+        drain();
+        return hasher.digest();
+    }
+
+    uint64_t size() {
+        drain();
+        return count;
+    }
+};
+
+// Writes a repo's tags out: codetags.md, or with a split one markdown file
+// per tag type or top-level directory under .codetags/ and codetags.md as
+// their index; and optionally JSON lines and a binary export for other
+// tools. Every file is streamed from a database snapshot, so memory grows
+// with the number of files, not with the tags or the text. Only outputs
+// whose tags changed are rendered, and only into a hash until it shows a
+// file's text differs from what the file holds.
+class CodetagsRenderer {
+private:
+    using FileRefs = std::vector<const FileTags*>;  // sorted by path
+
+    struct Section {
+        uint16_t type;
+        uint64_t offset;  // in codetags.md
+        uint64_t size;
+        uint64_t hash;
+        bool fresh;  // rendered by this call, not yet written
+    };
+
+    std::string repo_path;
+    std::string shard_dir;
+    OutputOptions options;
+    bool rendered = false;
+    std::map<std::string, uint64_t> hashes;   // output file -> hash of what was last written
+    std::map<std::string, size_t> shards;     // split: shard -> tag count, for the index
+    std::map<std::string, Section> sections;  // unsplit: type name -> its part of codetags.md
+
+    template <typename T>
+    static void put(std::ostream& out, T value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    // The types used in files, by name.
+    static std::vector<std::pair<std::string, uint16_t>> types_in(const FileRefs& files) {
+        std::vector<bool> seen;
+        std::vector<std::pair<std::string, uint16_t>> types;
+        for (const FileTags* file : files) {
+            for (const auto& tag : file->tags) {
+                if (tag.type >= seen.size()) seen.resize(tag.type + 1);
+                if (seen[tag.type]) continue;
+                seen[tag.type] = true;
+                types.emplace_back(TagTypes::name(tag.type), tag.type);
+            }
+        }
+        std::sort(types.begin(), types.end());
+        return types;
+    }
+
+    static void write_items(std::ostream& out, const FileRefs& files, uint16_t type) {
+        // Files share mtimes, so format each timestamp once
+        std::unordered_map<time_t, std::string> times;
+        std::string items;
+        for (const FileTags* file : files) {
+            items.clear();
+            const std::string* modified = nullptr;
+            for (const auto& tag : file->tags) {
+                if (tag.type != type) continue;
+                if (!modified) {
+                    auto it = times.find(file->last_modified);
+                    if (it == times.end()) {
+                        it = times.emplace(file->last_modified, Utils::format_time(file->last_modified)).first;
+                    }
+                    modified = &it->second;
+                }
+                items += "- **[";
+                items += Tag::format_id(tag.id);
+                items += "]** ";
+                items += file->content(tag);
+                items += "\n  - *File:* ";
+                items += file->relative_path();
+                items += ':';
+                items += std::to_string(tag.line_number);
+                items += "\n  - *Modified:* ";
+                items += *modified;
+                items += '\n';
+            }
+            out.write(items.data(), static_cast<std::streamsize>(items.size()));
+        }
+    }
+
+    static void write_section(std::ostream& out, const FileRefs& files, const std::string& name, uint16_t type) {
+        out << "## " << name << '\n';
+        write_items(out, files, type);
+    }
+
+    static void write_markdown(std::ostream& out, const FileRefs& files, const std::string& title) {
+        out << title << '\n';
+        for (const auto& [name, type] : types_in(files)) write_section(out, files, name, type);
+    }
+
+    static void write_jsonl(std::ostream& out, const FileRefs& files) {
+        std::vector<std::string> type_json;  // escaped names by type
+        std::string lines;
+        for (const FileTags* file : files) {
+            std::string file_json = "\",\"file\":\"" + Utils::json_escape(file->relative_path()) + "\",\"line\":";
+            std::string modified = ",\"modified\":" + std::to_string(static_cast<long long>(file->last_modified)) + "}\n";
+            lines.clear();
+            for (const auto& tag : file->tags) {
+                if (tag.type >= type_json.size()) type_json.resize(tag.type + 1);
+                if (type_json[tag.type].empty()) type_json[tag.type] = Utils::json_escape(TagTypes::name(tag.type));
+                lines += "{\"id\":\"";
+                lines += Tag::format_id(tag.id);
+                lines += "\",\"type\":\"";
+                lines += type_json[tag.type];
+                lines += "\",\"content\":\"";
+                lines += Utils::json_escape(file->content(tag));
+                lines += file_json;
+                lines += std::to_string(tag.line_number);
+                lines += modified;
+            }
+            out.write(lines.data(), static_cast<std::streamsize>(lines.size()));
+        }
+    }
+
+    // .codetags/tags.bin, laid out for tools that mmap it. Host byte order;
+    // records are 8-byte aligned:
+    //   header   "CTAGBIN1", u32 version (1), u32 type count, u32 file count,
+    //            u32 0, u64 tag count, u64 strings offset, u64 strings size
+    //   types    u64 name offset, u32 name length, u32 0
+    //   files    u64 path offset, i64 modified, u32 path length, u32 first tag,
+    //            u32 tag count, u32 0
+    //   tags     u64 content offset, u32 id, u32 line, u32 file, u16 type,
+    //            u16 content length
+    //   strings  the type names, then each file's path and tag contents
+    // String offsets are from the start of the strings. Files are sorted by
+    // path, and a file's tags, which are contiguous, by line.
+    static void write_binary(std::ostream& out, const FileRefs& files) {
+        auto types = types_in(files);
+        std::vector<uint16_t> type_index;
+        uint64_t names_size = 0;
+        for (size_t i = 0; i < types.size(); ++i) {
+            if (types[i].second >= type_index.size()) type_index.resize(types[i].second + 1);
+            type_index[types[i].second] = static_cast<uint16_t>(i);
+            names_size += types[i].first.size();
+        }
+        uint64_t tag_count = 0;
+        uint64_t strings_size = names_size;
+        for (const FileTags* file : files) {
+            tag_count += file->tags.size();
+            strings_size += file->relative_path().size() + file->text.size();
+        }
+
+        out.write("CTAGBIN1", 8);
+        put<uint32_t>(out, 1);
+        put<uint32_t>(out, static_cast<uint32_t>(types.size()));
+        put<uint32_t>(out, static_cast<uint32_t>(files.size()));
+        put<uint32_t>(out, 0);
+        put<uint64_t>(out, tag_count);
+        put<uint64_t>(out, 48 + 16 * types.size() + 32 * files.size() + 24 * tag_count);
+        put<uint64_t>(out, strings_size);
+
+        uint64_t offset = 0;
+        for (const auto& [name, _] : types) {
+            put<uint64_t>(out, offset);
+            put<uint32_t>(out, static_cast<uint32_t>(name.size()));
+            put<uint32_t>(out, 0);
+            offset += name.size();
+        }
+        uint32_t first_tag = 0;
+        for (const FileTags* file : files) {
+            put<uint64_t>(out, offset);
+            put<int64_t>(out, file->last_modified);
+            put<uint32_t>(out, static_cast<uint32_t>(file->relative_path().size()));
+            put<uint32_t>(out, first_tag);
+            put<uint32_t>(out, static_cast<uint32_t>(file->tags.size()));
+            put<uint32_t>(out, 0);
+            offset += file->relative_path().size() + file->text.size();
+            first_tag += static_cast<uint32_t>(file->tags.size());
+        }
+        offset = names_size;
+        for (uint32_t i = 0; i < files.size(); ++i) {
+            const FileTags* file = files[i];
+            offset += file->relative_path().size();
+            for (const auto& tag : file->tags) {
+                put<uint64_t>(out, offset + tag.content_offset);
+                put<uint32_t>(out, tag.id);
+                put<uint32_t>(out, tag.line_number);
+                put<uint32_t>(out, i);
+                put<uint16_t>(out, type_index[tag.type]);
+                put<uint16_t>(out, tag.content_length);
+            }
+            offset += file->text.size();
+        }
+        for (const auto& [name, _] : types) out << name;
+        for (const FileTags* file : files) out << file->relative_path() << file->text;
+    }
+
+    // Streams an output file into a hash, and only writes it out if it
+    // comes out different from last time (or, on the first render, from
+    // what is on disk, so a restart touches nothing).
+    bool replace_if_changed(const std::string& path, const std::function<void(std::ostream&)>& writer) {
+        HashingStreambuf sink;
+        std::ostream out(&sink);
+        writer(out);
+        uint64_t digest = sink.digest();
+        auto last = hashes.find(path);
+        if (last == hashes.end() && !rendered) last = hashes.emplace(path, ContentHasher::of_file(path)).first;
+        if (last != hashes.end() && last->second == digest) return false;
+        if (!Utils::write_file_atomic(path, writer)) return false;
+        hashes[path] = digest;
+        return true;
+    }
+
+    std::string shard_file(const std::string& shard) const {
+        return (shard.empty() ? "_root" : shard) + ".md";
+    }
+
+    // Clears out what an earlier run with other options left behind.
+    void remove_shards_except(const std::set<std::string>& keep) {
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(shard_dir, ec)) {
+            std::string name = entry.path().filename().string();
+            if (entry.path().extension() != ".md") continue;
+            std::string shard = name.substr(0, name.size() - 3);
+            if (shard == "_root") shard.clear();
+            if (!keep.count(shard)) fs::remove(entry.path(), ec);
+        }
+    }
+
+    // Copies a section out of codetags.md as last written.
+    static void copy_section(std::istream& from, const Section& section, std::ostream& to) {
+        char buffer[8192];
+        from.seekg(static_cast<std::streamoff>(section.offset));
+        for (uint64_t left = section.size; left > 0 && from;) {
+            auto n = static_cast<std::streamsize>(std::min<uint64_t>(left, sizeof(buffer)));
+            if (from.read(buffer, n)) to.write(buffer, n);
+            left -= n;
+        }
+        if (!from) to.setstate(std::ios::failbit);
+    }
+
+    // Unsplit codetags.md, kept as one section per tag type. The sections of
+    // the types that changed are rendered into a hash first, and the file is
+    // only replaced if one came out different; the others are then copied
+    // over from the file as last written instead of rendered again.
+    bool render_sections(const FileRefs& files, const std::set<uint16_t>& dirty_types) {
+        static const std::string title = "# Codetags\n";
+        std::string path = repo_path + "/codetags.md";
+
+        // With nothing to copy from, every section, and the file is compared
+        // with what is on disk
+        bool whole = !rendered || sections.empty();
+        std::vector<std::pair<std::string, uint16_t>> dirty;
+        if (whole) {
+            dirty = types_in(files);
+        } else {
+            for (uint16_t type : dirty_types) dirty.emplace_back(TagTypes::name(type), type);
+        }
+
+        HashingStreambuf whole_sink;
+        std::ostream whole_out(&whole_sink);
+        whole_out << title;
+        auto next = sections;
+        bool changed = false;
+        for (const auto& [name, type] : dirty) {
+            HashingStreambuf sink(whole ? &whole_sink : nullptr);
+            std::ostream out(&sink);
+            write_section(out, files, name, type);
+            Section section{type, 0, sink.size(), sink.digest(), true};
+            auto it = next.find(name);
+            if (section.size == name.size() + 4) {  // the heading alone: no tags left
+                if (it != next.end()) {
+                    next.erase(it);
+                    changed = true;
+                }
+            } else if (it == next.end() || it->second.hash != section.hash) {
+                next[name] = section;
+                changed = true;
+            }
+        }
+        if (whole) changed = whole_sink.digest() != ContentHasher::of_file(path);
+
+        // Clean sections are copied by their old offsets, so only from a
+        // file still laid out as last written
+        uint64_t last_size = title.size();
+        for (const auto& [_, section] : sections) last_size += section.size;
+        std::error_code ec;
+        bool can_copy = !whole && fs::file_size(path, ec) == last_size;
+        bool written = false;
+        if (changed) {
+            std::ifstream last;
+            if (can_copy) last.open(path, std::ios::binary);
+            written = Utils::write_file_atomic(path, [&](std::ostream& file) {
+                file << title;
+                for (const auto& [name, section] : next) {
+                    if (section.fresh || !can_copy) {
+                        write_section(file, files, name, section.type);
+                    } else {
+                        copy_section(last, section, file);
+                    }
+                }
+            });
+            if (!written) {
+                sections.clear();  // rendered whole next time
+                return false;
+            }
+        }
+        uint64_t offset = title.size();
+        for (auto& [_, section] : next) {
+            section.offset = offset;
+            section.fresh = false;
+            offset += section.size;
+        }
+        sections = std::move(next);
+        return written;
+    }
+
+    bool render_shards(const FileRefs& files, const std::set<uint16_t>& dirty_types,
+                       const std::set<std::string>& dirty_dirs) {
+        bool by_type = options.split == OutputOptions::TYPE;
+        std::set<std::string> dirty;
+        if (!rendered) {
+            // Everything, and nothing left over from an earlier run
+            if (by_type) {
+                for (const auto& [name, _] : types_in(files)) dirty.insert(name);
+            } else {
+                for (const FileTags* file : files) dirty.emplace(file->top_level_dir());
+            }
+            remove_shards_except(dirty);
+        } else if (by_type) {
+            for (uint16_t type : dirty_types) dirty.insert(TagTypes::name(type));
+        } else {
+            dirty = dirty_dirs;
+        }
+
+        bool wrote = false;
+        for (const auto& shard : dirty) {
+            std::optional<uint16_t> type = by_type ? TagTypes::find(shard) : std::nullopt;
+            FileRefs subset;
+            size_t count = 0;
+            for (const FileTags* file : files) {
+                size_t n = 0;
+                if (type) {
+                    for (const auto& tag : file->tags) n += tag.type == *type;
+                } else if (!by_type && file->top_level_dir() == shard) {
+                    n = file->tags.size();
+                }
+                if (n == 0) continue;
+                subset.push_back(file);
+                count += n;
+            }
+
+            std::string path = shard_dir + "/" + shard_file(shard);
+            if (count == 0) {
+                if (shards.erase(shard) > 0) {
+                    unlink(path.c_str());
+                    hashes.erase(path);
+                    wrote = true;
+                }
+                continue;
+            }
+            shards[shard] = count;
+            wrote |= replace_if_changed(path, [&](std::ostream& out) {
+                if (type) {
+                    out << "# Codetags: " << shard << "\n\n";
+                    write_items(out, subset, *type);
+                } else {
+                    write_markdown(out, subset, "# Codetags: " + (shard.empty() ? "(root)" : shard + "/") + "\n");
+                }
+            });
+        }
+
+        wrote |= replace_if_changed(repo_path + "/codetags.md", [&](std::ostream& out) {
+            out << "# Codetags\n";
+            for (const auto& [shard, count] : shards) {
+                std::string label = by_type ? shard : shard.empty() ? "(root)" : shard + "/";
+                out << "- [" << label << "](<.codetags/" << shard_file(shard) << ">): " << count
+                    << (count == 1 ? " tag\n" : " tags\n");
+            }
+        });
+        return wrote;
+    }
+
+public:
+    explicit CodetagsRenderer(std::string repo, OutputOptions outputs = {})
+        : repo_path(std::move(repo)), shard_dir(repo_path + "/.codetags"), options(outputs) {}
+
+    // Renders what changed since the last call; the first call renders
+    // everything. Returns true if a file was written.
+    bool render(TagDatabase& db) {
+        auto dirty_types = db.take_dirty_types();
+        auto dirty_dirs = db.take_dirty_dirs();
+        if (rendered && dirty_types.empty() && dirty_dirs.empty()) return false;
+
+        // The snapshot keeps the files the refs point to alive
+        auto snapshot = db.snapshot();
+        FileRefs files;
+        snapshot.for_each_file([&](const FileTags& file) { files.push_back(&file); });
+        std::sort(files.begin(), files.end(),
+                  [](const FileTags* a, const FileTags* b) { return a->file_path < b->file_path; });
+
+        std::error_code ec;
+        if (options.jsonl || options.binary || (options.markdown && options.split != OutputOptions::NONE)) {
+            fs::create_directories(shard_dir, ec);
+        }
+        if (!rendered) {
+            if (!options.markdown || options.split == OutputOptions::NONE) remove_shards_except({});
+            if (!options.jsonl) fs::remove(shard_dir + "/tags.jsonl", ec);
+            if (!options.binary) fs::remove(shard_dir + "/tags.bin", ec);
+        }
+        bool wrote = false;
+        if (options.markdown && options.split == OutputOptions::NONE) {
+            wrote |= render_sections(files, dirty_types);
+        } else if (options.markdown) {
+            wrote |= render_shards(files, dirty_types, dirty_dirs);
+        }
+        if (options.jsonl) {
+            wrote |= replace_if_changed(shard_dir + "/tags.jsonl", [&](std::ostream& out) { write_jsonl(out, files); });
+        }
+        if (options.binary) {
+            wrote |= replace_if_changed(shard_dir + "/tags.bin", [&](std::ostream& out) { write_binary(out, files); });
+        }
+        rendered = true;
+        return wrote;
+    }
+};
+
+// ======================
+// IgnoreMatcher
+// ======================
+
+// .ctagsignore patterns compiled into per-segment matchers. Patterns without
+// a slash match a file or directory name at any depth; patterns containing
+// one are anchored to the repository root. A directory's verdict is cached,
+// so everything below an ignored (or kept) directory costs one lookup plus
+// a match of its own name.
+class IgnoreMatcher {
+private:
+    struct Segment {
+        enum Kind { LITERAL, PREFIX, SUFFIX, ANY, GLOB, RECURSIVE } kind;
+        std::string text;
+
+        bool matches(std::string_view name) const {
+            switch (kind) {
+            case LITERAL: return name == text;
+            case PREFIX: return name.size() >= text.size() && name.compare(0, text.size(), text) == 0;
+            case SUFFIX: return name.size() >= text.size() &&
+                                name.compare(name.size() - text.size(), text.size(), text) == 0;
+            case ANY: return !name.empty();
+            case RECURSIVE: return true;
+            case GLOB: return fnmatch(text.c_str(), std::string(name).c_str(), 0) == 0;
+            }
+            return false;
+        }
+    };
+
+    struct Pattern {
+        std::vector<Segment> segments;
+        bool dir_only = false;
+        bool anchored = false;
+    };
+
+    struct PathHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+    };
+
+    std::vector<Pattern> patterns;
+    mutable std::shared_mutex cache_mutex;
+    mutable std::unordered_map<std::string, bool, PathHash, std::equal_to<>> dir_cache;
+
+    static Segment compile_segment(std::string_view text) {
+        if (text == "**") return {Segment::RECURSIVE, ""};
+        if (text == "*") return {Segment::ANY, ""};
+        size_t special = text.find_first_of("*?[\\");
+        if (special == std::string_view::npos) return {Segment::LITERAL, std::string(text)};
+        std::string_view rest = text.substr(1);
+        if (text[0] == '*' && rest.find_first_of("*?[\\") == std::string_view::npos) {
+            return {Segment::SUFFIX, std::string(rest)};
+        }
+        if (special == text.size() - 1 && text.back() == '*') {
+            return {Segment::PREFIX, std::string(text.substr(0, special))};
+        }
+        return {Segment::GLOB, std::string(text)};
+    }
+
+    static std::vector<std::string_view> split(std::string_view path) {
+        std::vector<std::string_view> parts;
+        size_t start = 0;
+        while (start <= path.size()) {
+            size_t slash = path.find('/', start);
+            if (slash == std::string_view::npos) slash = path.size();
+            if (slash > start) parts.push_back(path.substr(start, slash - start));
+            start = slash + 1;
+        }
+        return parts;
+    }
+
+    static bool match_segments(const std::vector<Segment>& pat, size_t pi,
+                               const std::vector<std::string_view>& parts, size_t si) {
+        while (pi < pat.size()) {
+            if (pat[pi].kind == Segment::RECURSIVE) {
+                for (size_t skip = si; skip <= parts.size(); ++skip) {
+                    if (match_segments(pat, pi + 1, parts, skip)) return true;
+                }
+                return false;
+            }
+            if (si >= parts.size() || !pat[pi].matches(parts[si])) return false;
+            ++pi;
+            ++si;
+        }
+        return si == parts.size();
+    }
+
+    // Matches the patterns against this exact entry, not its ancestors.
+    bool entry_matches(std::string_view rel_path, bool is_dir) const {
+        size_t slash = rel_path.rfind('/');
+        std::string_view name = slash == std::string_view::npos ? rel_path : rel_path.substr(slash + 1);
+        std::vector<std::string_view> parts;
+        for (const auto& pattern : patterns) {
+            if (pattern.dir_only && !is_dir) continue;
+            if (!pattern.anchored) {
+                if (pattern.segments[0].matches(name)) return true;
+                continue;
+            }
+            if (parts.empty()) parts = split(rel_path);
+            if (match_segments(pattern.segments, 0, parts, 0)) return true;
+        }
+        return false;
+    }
+
+    bool dir_ignored(std::string_view dir) const {
+        if (dir.empty()) return false;
+        {
+            std::shared_lock<std::shared_mutex> lock(cache_mutex);
+            auto it = dir_cache.find(dir);
+            if (it != dir_cache.end()) return it->second;
+        }
+        size_t slash = dir.rfind('/');
+        bool ignored = (slash != std::string_view::npos && dir_ignored(dir.substr(0, slash))) ||
+                       entry_matches(dir, true);
+        std::unique_lock<std::shared_mutex> lock(cache_mutex);
+        dir_cache.emplace(std::string(dir), ignored);
+        return ignored;
+    }
+
+public:
+    explicit IgnoreMatcher(const std::vector<std::string>& lines) {
+        for (std::string line : lines) {
+            while (!line.empty() && (line.back() == ' ' || line.back() == '\r')) line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+
+            Pattern pattern;
+            if (line.back() == '/') {
+                pattern.dir_only = true;
+                line.pop_back();
+            }
+            if (line.find('/') != std::string::npos) pattern.anchored = true;
+            for (auto part : split(line)) {
+                pattern.segments.push_back(compile_segment(part));
+            }
+            if (pattern.segments.empty()) continue;
+            if (pattern.segments.size() == 1 && pattern.segments[0].kind == Segment::RECURSIVE) {
+                pattern.anchored = false;
+                pattern.segments[0].kind = Segment::ANY;
+            }
+            patterns.push_back(std::move(pattern));
+        }
+    }
+
+    // From an ignore file; no patterns if it can't be read.
+    static std::shared_ptr<const IgnoreMatcher> load(const std::string& path) {
+        std::vector<std::string> lines;
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line)) {
+            if (!line.empty() && line[0] != '#' && line[0] != ' ') {
+                lines.push_back(line);
+            }
+        }
+        return std::make_shared<const IgnoreMatcher>(lines);
+    }
+
+    bool empty() const { return patterns.empty(); }
+
+    // rel_path is relative to the repository root, without a leading slash.
+    bool matches(std::string_view rel_path, bool is_dir = false) const {
+        if (patterns.empty() || rel_path.empty()) return false;
+        size_t slash = rel_path.rfind('/');
+        if (slash != std::string_view::npos && dir_ignored(rel_path.substr(0, slash))) return true;
+        return is_dir ? dir_ignored(rel_path) : entry_matches(rel_path, false);
+    }
+};
+
+// One level of a directory walk. The daemon and codetags scan both list
+// directories through this, so they see the same files: symlinks are not
+// followed, .git is never entered, and skip(path, is_dir) drops the rest.
+struct TreeWalk {
+    using Skip = std::function<bool(const std::string& path, bool is_dir)>;
+    using Visit = std::function<void(std::string path)>;
+
+    static bool enters(std::string_view dir) {
+        size_t slash = dir.rfind('/');
+        return dir.substr(slash == std::string_view::npos ? 0 : slash + 1) != ".git";
+    }
+
+    static void list(const std::string& dir, const Skip& skip, const Visit& on_file, const Visit& on_dir,
+                     std::error_code& ec) {
+        fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec);
+        for (; !ec && it != fs::directory_iterator(); it.increment(ec)) {
+            std::error_code type_ec;
+            if (it->is_symlink(type_ec)) continue;
+            std::string path = it->path().string();
+            if (it->is_directory(type_ec)) {
+                if (enters(path) && !skip(path, true)) on_dir(std::move(path));
+            } else if (it->is_regular_file(type_ec) && !skip(path, false)) {
+                on_file(std::move(path));
+            }
+        }
+    }
+};
+
+// ======================
+// Metrics
+// ======================
+
+// Latency histogram with fixed buckets, updated lock-free from any thread.
+class Histogram {
+public:
+    static constexpr std::array<double, 12> bounds = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+                                                      0.01,   0.025,   0.05,   0.1,   0.5,    2.5};  // seconds
+
+private:
+    std::array<std::atomic<uint64_t>, bounds.size() + 1> buckets{};  // the last one is +Inf
+    std::atomic<uint64_t> sum_ns{0};
+
+public:
+    void observe(std::chrono::steady_clock::duration elapsed) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        double seconds = ns / 1e9;
+        size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), seconds) - bounds.begin();
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        sum_ns.fetch_add(static_cast<uint64_t>(ns), std::memory_order_relaxed);
+    }
+
+    uint64_t bucket(size_t index) const { return buckets[index].load(std::memory_order_relaxed); }
+    double sum() const { return sum_ns.load(std::memory_order_relaxed) / 1e9; }
+};
+
+// Times a scope into a histogram.
+class ScopedTimer {
+private:
+    Histogram& histogram;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+public:
+    explicit ScopedTimer(Histogram& h) : histogram(h) {}
+    ~ScopedTimer() { histogram.observe(std::chrono::steady_clock::now() - start); }
+};
+
+// Builds a Prometheus text exposition. Samples are grouped by metric as the
+// format requires, whatever order the repos add them in.
+class MetricsText {
+private:
+    struct Family {
+        std::string header;  // HELP and TYPE
+        std::string samples;
+    };
+    std::vector<std::string> order;
+    std::unordered_map<std::string, Family> families;
+
+    Family& family(const std::string& name, const char* type, const char* help) {
+        auto [it, added] = families.try_emplace(name);
+        if (added) {
+            order.push_back(name);
+            it->second.header = "# HELP " + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+        }
+        return it->second;
+    }
+
+    static std::string number(double value) {
+        std::ostringstream out;
+        out << std::setprecision(12) << value;
+        return out.str();
+    }
+
+    static std::string sample(const std::string& name, const std::string& labels, const std::string& value) {
+        return name + (labels.empty() ? "" : "{" + labels + "}") + " " + value + "\n";
+    }
+
+public:
+    // Label values are escaped as the format asks.
+    static std::string label(const std::string& name, std::string_view value) {
+        std::string out = name + "=\"";
+        for (char c : value) {
+            if (c == '\\' || c == '"') out += '\\';
+            if (c == '\n') {
+                out += "\\n";
+                continue;
+            }
+            out += c;
+        }
+        return out + "\"";
+    }
+
+    void counter(const std::string& name, const char* help, const std::string& labels, double value) {
+        family(name, "counter", help).samples += sample(name, labels, number(value));
+    }
+
+    void gauge(const std::string& name, const char* help, const std::string& labels, double value) {
+        family(name, "gauge", help).samples += sample(name, labels, number(value));
+    }
+
+    void histogram(const std::string& name, const char* help, const std::string& labels, const Histogram& h) {
+        auto& f = family(name, "histogram", help);
+        std::string prefix = labels.empty() ? "" : labels + ",";
+        uint64_t total = 0;
+        for (size_t i = 0; i <= Histogram::bounds.size(); ++i) {
+            total += h.bucket(i);
+            std::string le = i < Histogram::bounds.size() ? number(Histogram::bounds[i]) : "+Inf";
+            f.samples += sample(name + "_bucket", prefix + "le=\"" + le + "\"", std::to_string(total));
+        }
+        f.samples += sample(name + "_sum", labels, number(h.sum()));
+        f.samples += sample(name + "_count", labels, std::to_string(total));
+    }
+
+    std::string str() const {
+        std::string out;
+        for (const auto& name : order) {
+            const auto& f = families.at(name);
+            out += f.header + f.samples;
+        }
+        return out;
+    }
+};
+
+// ======================
+// FileWatcher
+// ======================
+
+class FileWatcher {
+private:
+    std::string directory_path;
+    std::string ignore_file_path;
+    std::atomic<bool> running{false};
+    EventLoop* loop;  // null for one-shot scans that don't follow changes
+    int inotify_fd{-1};
+    EventDebouncer debouncer;  // loop thread only
+
+    // At most one job (startup scan or an event batch) runs per repo at a time
+    std::mutex job_mutex;
+    std::condition_variable job_cv;
+    bool job_running = false;
+    std::atomic<std::shared_ptr<const IgnoreMatcher>> ignore_matcher;
+    std::mutex render_mutex;
+    CodetagsRenderer renderer;
+    bool render_pending = false;
+    std::chrono::steady_clock::time_point last_render{};
+    std::shared_ptr<TagDatabase> tag_db;  // Each repo has its own database
+    std::shared_ptr<ThreadPool> pool;     // Shared with the other repos
+    std::shared_ptr<const TagMatcher> matcher;
+    Config config;
+
+    struct KnownFile {
+        FileStamp stamp;
+        uint64_t content_hash = 0;
+    };
+
+    std::mutex stamp_mutex;
+    std::map<std::string, KnownFile> known_files;  // sorted, so a directory's files are one range
+    std::unordered_map<std::string, FileStamp> own_writes;  // files we stamped IDs into
+    std::unique_ptr<TagIndex> index;                           // null if not persisted
+    std::unordered_map<std::string, TagIndex::Entry> persisted;  // previous run, during initial scan
+    std::mutex watch_mutex;
+    std::unordered_map<int, std::string> wd_to_path;
+    struct WatchedDir {
+        int wd;
+        int64_t mtime_ns;  // when the watch was placed or a resync last listed it
+    };
+    std::map<std::string, WatchedDir> path_to_wd;  // also the manifest a resync compares against
+    std::atomic<size_t> watch_count{0};
+    bool watch_limit_reported = false;
+
+    // Git index mode (config.git_index): files come from the index, and a
+    // checkout is handled as one reconcile once git is done
+    std::string git_dir;                             // empty unless in that mode
+    bool git_pending = false;                        // loop thread only, like the three below
+    EventDebouncer::Clock::time_point git_started_at{};
+    EventDebouncer::Clock::time_point git_event_at{};
+    std::set<std::string> held;                      // work tree events while git was busy
+
+    // Renames: an IN_MOVED_FROM waits for the IN_MOVED_TO with the same
+    // cookie, and the pair is applied as a re-root instead of a reparse
+    struct PendingMove {
+        std::string path;
+        bool is_dir;
+        EventDebouncer::Clock::time_point at;
+    };
+    static constexpr std::chrono::milliseconds move_timeout{50};  // then it's a plain delete
+    std::unordered_map<uint32_t, PendingMove> moved_from;          // loop thread only, like the three below
+    std::vector<std::pair<std::string, std::string>> paired_moves;  // for the next job
+    std::vector<std::string> in_flight;                             // paths of the running batch
+    bool in_flight_unknown = false;  // the running job reads paths it didn't list (scan, reconcile)
+    bool overflowed = false;         // events were lost; loop thread only
+    std::vector<std::string> new_dirs;  // created or moved in, to be walked; loop thread only
+
+    struct Counters {
+        std::atomic<uint64_t> inotify_reads{0};
+        std::atomic<uint64_t> events{0};
+        std::atomic<uint64_t> overflows{0};
+        std::atomic<uint64_t> renames{0};
+        std::atomic<uint64_t> batches{0};
+        std::atomic<uint64_t> batch_paths{0};
+        std::atomic<uint64_t> files_parsed{0};
+        std::atomic<uint64_t> files_unchanged{0};
+        std::atomic<uint64_t> files_reused{0};
+        std::atomic<uint64_t> files_stamped{0};
+        std::atomic<uint64_t> files_skipped_large{0};
+        std::atomic<uint64_t> files_skipped_binary{0};
+        std::atomic<uint64_t> long_lines{0};
+        std::atomic<uint64_t> ids_restamped{0};
+        std::atomic<uint64_t> renders{0};
+        std::atomic<uint64_t> render_writes{0};
+        Histogram read_seconds;    // handling one read() of the inotify fd
+        Histogram batch_seconds;   // bringing one batch of changed paths up to date
+        Histogram parse_seconds;   // one file
+        Histogram render_seconds;  // one update of codetags.md
+    } metrics;
+
+    void load_ignore_patterns() {
+        ignore_matcher.store(IgnoreMatcher::load(ignore_file_path));
+    }
+
+    bool should_ignore(const std::string& path, bool is_dir = false) const {
+        std::string_view rel_path = path;
+        if (path.length() > directory_path.length() &&
+            path.compare(0, directory_path.length(), directory_path) == 0 &&
+            path[directory_path.length()] == '/') {
+            rel_path.remove_prefix(directory_path.length() + 1);
+        } else if (path == directory_path) {
+            return false;
+        }
+        return ignore_matcher.load()->matches(rel_path, is_dir);
+    }
+
+    void update_codetags_file() {
+        std::lock_guard<std::mutex> lock(render_mutex);
+        render_pending = false;
+        last_render = std::chrono::steady_clock::now();
+        ScopedTimer timer(metrics.render_seconds);
+        metrics.renders++;
+        try {
+            if (renderer.render(*tag_db)) metrics.render_writes++;
+        } catch (...) {}
+    }
+
+    // Renders now if the last render is at least one flush interval old;
+    // otherwise leaves it for the watcher loop.
+    void request_render() {
+        {
+            std::lock_guard<std::mutex> lock(render_mutex);
+            render_pending = true;
+            if (std::chrono::steady_clock::now() < last_render + config.flush_interval) return;
+        }
+        update_codetags_file();
+    }
+
+    std::optional<std::chrono::steady_clock::time_point> render_deadline() {
+        std::lock_guard<std::mutex> lock(render_mutex);
+        if (!render_pending) return std::nullopt;
+        return last_render + config.flush_interval;
+    }
+
+    bool is_source_path(const std::string& filepath) const {
+        fs::path p(filepath);
+        if (!p.has_extension()) return false;
+        return TagParser::is_source_file(p.extension().string());
+    }
+
+    void forget_file(const std::string& filepath) {
+        std::lock_guard<std::mutex> lock(stamp_mutex);
+        known_files.erase(filepath);
+        own_writes.erase(filepath);
+    }
+
+    // Removes the watches on path and the directories below it. A directory
+    // moved within the repo keeps its wd, which by now maps to the new path.
+    void unwatch_subtree(const std::string& path) {
+        std::lock_guard<std::mutex> lock(watch_mutex);
+        for (const auto& dir : Utils::subtree_keys(path_to_wd, path)) {
+            if (dir == directory_path) continue;
+            int wd = path_to_wd[dir].wd;
+            auto it = wd_to_path.find(wd);
+            if (it != wd_to_path.end() && it->second == dir) {
+                inotify_rm_watch(inotify_fd, wd);
+                wd_to_path.erase(it);
+            }
+            path_to_wd.erase(dir);
+        }
+        watch_count = wd_to_path.size();
+    }
+
+    // Removes the tags, stamps and watches of path and everything below it,
+    // e.g. once a file or directory is deleted, moved away or ignored.
+    void drop_subtree(const std::string& path) {
+        tag_db->remove_subtree(path);
+        std::vector<ParsedFile> removed;
+        {
+            std::lock_guard<std::mutex> lock(stamp_mutex);
+            for (auto& file : Utils::subtree_keys(known_files, path)) {
+                known_files.erase(file);
+                own_writes.erase(file);
+                removed.push_back(ParsedFile{std::move(file), {}, std::nullopt, 0});
+            }
+        }
+        unwatch_subtree(path);
+        if (index && !removed.empty()) index->append(removed);
+    }
+
+    // Points the watches of a renamed directory and of those below it at
+    // their new paths; inotify keeps the descriptors across a rename.
+    void rewatch_subtree(const std::string& from, const std::string& to) {
+        unwatch_subtree(to);  // a directory the rename replaced
+        std::lock_guard<std::mutex> lock(watch_mutex);
+        for (const auto& dir : Utils::subtree_keys(path_to_wd, from)) {
+            auto node = path_to_wd.extract(dir);
+            node.key() = to + dir.substr(from.size());
+            wd_to_path[node.mapped().wd] = node.key();
+            path_to_wd.insert(std::move(node));
+        }
+        watch_count = wd_to_path.size();
+    }
+
+    // Moves the tags, stamps and journal entries of from and everything below
+    // it to the same place under to, without reading any file again.
+    void apply_move(const std::string& from, const std::string& to) {
+        tag_db->remove_subtree(to);  // whatever the rename replaced
+        tag_db->move_subtree(from, to, directory_path);
+
+        std::vector<ParsedFile> journal;
+        std::vector<std::string> now_ignored;
+        {
+            std::lock_guard<std::mutex> lock(stamp_mutex);
+            for (const auto& path : Utils::subtree_keys(known_files, to)) known_files.erase(path);
+            for (const auto& old_path : Utils::subtree_keys(known_files, from)) {
+                auto node = known_files.extract(old_path);
+                node.key() = to + old_path.substr(from.size());
+                const KnownFile& known = node.mapped();
+                journal.push_back(ParsedFile{old_path, {}, std::nullopt, 0});
+                journal.push_back(ParsedFile{node.key(), tag_db->get_tags_in_file(node.key()), known.stamp,
+                                             known.content_hash});
+                if (should_ignore(node.key())) now_ignored.push_back(node.key());
+                known_files.insert(std::move(node));
+            }
+            std::vector<std::string> stamped;
+            for (const auto& [path, _] : own_writes) {
+                if (Utils::in_subtree(path, from)) stamped.push_back(path);
+            }
+            for (const auto& path : stamped) {
+                auto node = own_writes.extract(path);
+                node.key() = to + path.substr(from.size());
+                own_writes.insert(std::move(node));
+            }
+        }
+        if (index && !journal.empty()) index->append(journal);
+
+        // Patterns anchored to a path may match at the new place
+        {
+            std::lock_guard<std::mutex> lock(watch_mutex);
+            for (const auto& dir : Utils::subtree_keys(path_to_wd, to)) {
+                if (should_ignore(dir, true)) now_ignored.push_back(dir);
+            }
+        }
+        for (const auto& path : now_ignored) drop_subtree(path);
+        request_render();
+    }
+
+    // Takes the tags saved by the previous run if the file's stamp still
+    // matches, or failing that, if its content hash does.
+    bool reuse_persisted(const std::string& filepath, const FileStamp& stamp, time_t mtime, ParsedFile& out) {
+        auto it = persisted.find(filepath);
+        if (it == persisted.end()) return false;
+        const auto& entry = it->second;
+        if (!(entry.stamp == stamp)) {
+            if (entry.content_hash == 0 || static_cast<uint64_t>(stamp.size) > config.limits.max_file_size ||
+                ContentHasher::of_file(filepath) != entry.content_hash) {
+                return false;
+            }
+        }
+        out.tags = entry.tags;
+        if (out.tags && out.tags->last_modified != mtime) {
+            FileTags touched = *out.tags;
+            touched.last_modified = mtime;
+            out.tags = std::make_shared<const FileTags>(std::move(touched));
+        }
+        out.content_hash = entry.content_hash;
+        return true;
+    }
+
+    // Stats and parses a file if it changed since it was last seen.
+    // Returns false when the file is unchanged and nothing needs merging.
+    // contested is set if the file kept an ID held by a deferred file.
+    bool parse_if_changed(TagParser& parser, const std::string& filepath, ParsedFile& out, bool& contested) {
+        out = ParsedFile{filepath, {}, std::nullopt, 0};
+
+        struct stat st;
+        if (stat(filepath.c_str(), &st) != 0) {
+            forget_file(filepath);
+            return true;
+        }
+
+        FileStamp stamp = FileStamp::from_stat(st);
+        {
+            std::lock_guard<std::mutex> lock(stamp_mutex);
+            auto it = known_files.find(filepath);
+            if (it != known_files.end() && it->second.stamp == stamp) {
+                metrics.files_unchanged++;
+                return false;
+            }
+            known_files[filepath] = {stamp, 0};
+        }
+        out.stamp = stamp;
+
+        bool reused = reuse_persisted(filepath, stamp, st.st_mtime, out) &&
+                      (!out.tags || parser.claim_ids(*out.tags, contested));
+        if (reused) {
+            metrics.files_reused++;
+        } else {
+            TagParser::ParseInfo info;
+            {
+                ScopedTimer timer(metrics.parse_seconds);
+                out.tags = parser.parse_file(filepath, directory_path, st.st_mtime, &info);
+            }
+            if (info.skipped == TagParser::ParseInfo::TOO_LARGE) {
+                metrics.files_skipped_large++;
+            } else if (info.skipped == TagParser::ParseInfo::BINARY) {
+                metrics.files_skipped_binary++;
+            } else {
+                metrics.files_parsed++;
+            }
+            metrics.long_lines += info.long_lines;
+            metrics.ids_restamped += info.restamped;
+            contested = info.contested;
+            out.content_hash = info.content_hash;
+            if (info.written) {
+                metrics.files_stamped++;
+                out.stamp = info.written;
+                out.content_hash = 0;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(stamp_mutex);
+        known_files[filepath] = {*out.stamp, out.content_hash};
+        if (!(*out.stamp == stamp)) own_writes[filepath] = *out.stamp;
+        return true;
+    }
+
+    // True if the event was raised by our own ID stamping: the temp file, or
+    // the target while it still looks exactly as we left it.
+    bool is_own_write(const std::string& filepath) {
+        if (Utils::is_temp_path(filepath)) return true;
+
+        std::lock_guard<std::mutex> lock(stamp_mutex);
+        auto it = own_writes.find(filepath);
+        if (it == own_writes.end()) return false;
+        auto stamp = FileStamp::of(filepath);
+        bool own = stamp && *stamp == it->second;
+        own_writes.erase(it);
+        return own;
+    }
+
+    // Parses files on the shared pool, merging results into the database
+    // (and the journal, if asked) one batch at a time.
+    // A file can only keep an ID no other file holds. When the holder is in
+    // the same set it may be giving the ID up, so such conflicts are settled
+    // once the set is merged; a copy's IDs are replaced as it is parsed.
+    void parse_files(std::vector<std::string> files, bool journal, bool defer_conflicts = true) {
+        constexpr size_t batch_size = 64;
+        // Grouping by database shard keeps each batch's commit to a shard or two
+        if (files.size() > batch_size) {
+            std::vector<std::pair<size_t, std::string>> keyed;
+            keyed.reserve(files.size());
+            for (auto& file : files) keyed.emplace_back(TagDatabase::shard_of(file), std::move(file));
+            std::stable_sort(keyed.begin(), keyed.end(),
+                             [](const auto& a, const auto& b) { return a.first < b.first; });
+            for (size_t i = 0; i < files.size(); ++i) files[i] = std::move(keyed[i].second);
+        }
+        std::unordered_set<IdIndex::Owner> owners;
+        if (defer_conflicts) {
+            for (const auto& file : files) owners.insert(IdIndex::owner_of(file));
+        }
+        std::mutex contested_mutex;
+        std::vector<std::string> contested;
+
+        size_t batch_count = (files.size() + batch_size - 1) / batch_size;
+        pool->parallel_for(batch_count, [&](size_t b) {
+            TagParser parser(matcher, config.limits, &tag_db->ids());
+            if (defer_conflicts) parser.defer_conflicts_with(&owners);
+            std::vector<ParsedFile> batch;
+            batch.reserve(batch_size);
+            size_t end = std::min(files.size(), (b + 1) * batch_size);
+            for (size_t i = b * batch_size; i < end; ++i) {
+                ParsedFile parsed;
+                bool kept_held_id = false;
+                if (parse_if_changed(parser, files[i], parsed, kept_held_id)) {
+                    batch.push_back(std::move(parsed));
+                }
+                if (kept_held_id) {
+                    std::lock_guard<std::mutex> lock(contested_mutex);
+                    contested.push_back(files[i]);
+                }
+            }
+            tag_db->replace_files(batch);
+            if (journal && index) index->append(batch);
+        });
+
+        // The holder has been merged: either it let the ID go, or the ID is
+        // a duplicate after all. Then keeps_id picks the file that keeps it,
+        // whichever was parsed first, and the other is parsed again to
+        // replace it.
+        std::unordered_map<IdIndex::Owner, const std::string*> deferred;
+        if (!contested.empty()) {
+            for (const auto& file : files) deferred.emplace(IdIndex::owner_of(file), &file);
+        }
+        IdIndex& ids = tag_db->ids();
+        std::set<std::string> duplicates;
+        for (const auto& path : contested) {
+            auto tags = tag_db->get_tags_in_file(path);
+            if (!tags) continue;
+            IdIndex::Owner owner = IdIndex::owner_of(path);
+            for (const auto& tag : tags->tags) {
+                IdIndex::Owner holder;
+                if (ids.claim(tag.id, owner, &holder)) continue;
+                auto it = deferred.find(holder);
+                if (it != deferred.end() && keeps_id(path, *it->second, tag.id)) {
+                    ids.transfer(tag.id, holder, owner);
+                    duplicates.insert(*it->second);
+                } else {
+                    duplicates.insert(path);
+                }
+            }
+        }
+        if (duplicates.empty()) return;
+        {
+            std::lock_guard<std::mutex> lock(stamp_mutex);
+            for (const auto& path : duplicates) known_files.erase(path);
+        }
+        parse_files(std::vector<std::string>(duplicates.begin(), duplicates.end()), journal, false);
+    }
+
+    // Of two files holding the same ID, whether a keeps it rather than b:
+    // the file the index had it in wins (the other was copied while the
+    // daemon was down), otherwise the first by path. Never the order the
+    // workers happened to parse them in.
+    bool keeps_id(const std::string& a, const std::string& b, uint32_t id) const {
+        auto had = [&](const std::string& path) {
+            auto it = persisted.find(path);
+            if (it == persisted.end() || !it->second.tags) return false;
+            const auto& tags = it->second.tags->tags;
+            return std::any_of(tags.begin(), tags.end(), [&](const Tag& tag) { return tag.id == id; });
+        };
+        bool a_had = had(a);
+        bool b_had = had(b);
+        return a_had != b_had ? a_had : a < b;
+    }
+
+    void compact_index() {
+        if (!index) return;
+        std::vector<std::pair<std::string, KnownFile>> files;
+        {
+            std::lock_guard<std::mutex> lock(stamp_mutex);
+            files.assign(known_files.begin(), known_files.end());
+        }
+        index->compact([&](const TagIndex::EntrySink& sink) {
+            for (const auto& [path, known] : files) {
+                sink(path, TagIndex::Entry{known.stamp, known.content_hash, tag_db->get_tags_in_file(path)});
+            }
+        });
+    }
+
+    // Brings a set of changed paths (created, modified or deleted) up to date
+    // and re-renders codetags.md once for the whole set.
+    void process_batch(const std::vector<std::string>& paths) {
+        ScopedTimer timer(metrics.batch_seconds);
+        metrics.batches++;
+        metrics.batch_paths += paths.size();
+        std::vector<std::string> files;
+        for (const auto& filepath : paths) {
+            std::error_code ec;
+            if (should_ignore(filepath)) {
+                drop_subtree(filepath);
+            } else if (is_source_path(filepath)) {
+                files.push_back(filepath);
+            } else if (!fs::exists(filepath, ec)) {
+                drop_subtree(filepath);  // a directory deleted or moved away
+            }
+        }
+        parse_files(std::move(files), true);
+        if (index && index->needs_compaction()) compact_index();
+        request_render();
+    }
+
+    // Parses the files found by the startup walk, reusing the previous run's
+    // results for files that did not change in between.
+    void initial_scan(std::vector<std::string> files) {
+        if (index) persisted = index->load();
+
+        parse_files(std::move(files), false);
+        persisted.clear();
+        compact_index();
+        update_codetags_file();
+    }
+
+    // Visits every regular file below root without descending into ignored
+    // directories; on_dir, if given, is called for each directory kept.
+    void walk_tree(const std::string& root, const std::function<void(const std::string&)>& on_file,
+                   const std::function<void(const std::string&)>& on_dir = nullptr) const {
+        auto skip = [this](const std::string& path, bool is_dir) { return should_ignore(path, is_dir); };
+        std::vector<std::string> pending{root};
+        while (!pending.empty()) {
+            std::string dir = std::move(pending.back());
+            pending.pop_back();
+            std::error_code ec;
+            TreeWalk::list(dir, skip, [&](std::string file) { on_file(file); },
+                           [&](std::string sub) {
+                               if (on_dir) on_dir(sub);
+                               pending.push_back(std::move(sub));
+                           },
+                           ec);
+            if (ec && ec != std::errc::no_such_file_or_directory) {  // not removed meanwhile
+                std::cerr << "[FileWatcher] Filesystem error while walking " << dir << ": " << ec.message()
+                          << std::endl;
+            }
+        }
+    }
+
+    // Adds the directories between path and the repo root to dirs.
+    void collect_parents(const std::string& path, std::unordered_set<std::string>& dirs) const {
+        size_t slash = path.rfind('/');
+        while (slash != std::string::npos && slash > directory_path.size()) {
+            if (!dirs.insert(path.substr(0, slash)).second) return;  // and so are its parents
+            slash = path.rfind('/', slash - 1);
+        }
+    }
+
+    // Lists the files to scan and the directories to watch. In git index
+    // mode these are the tracked files and the directories holding them, so
+    // untracked build output is never visited; otherwise the whole tree.
+    void list_tree(const std::function<void(const std::string&)>& on_file,
+                   const std::function<void(const std::string&)>& on_dir) const {
+        std::vector<GitIndex::Entry> entries;
+        if (git_dir.empty() || !GitIndex::read(git_dir + "/index", entries)) {
+            walk_tree(directory_path, on_file, on_dir);
+            return;
+        }
+        std::unordered_set<std::string> dirs;
+        for (const auto& entry : entries) {
+            std::string path = directory_path + "/" + entry.path;
+            if (should_ignore(path)) continue;
+            on_file(path);
+            collect_parents(path, dirs);
+        }
+        for (const auto& dir : dirs) {
+            if (!should_ignore(dir, true)) on_dir(dir);
+        }
+    }
+
+    // After git rewrote the work tree (checkout, reset, merge...): only the
+    // tracked files whose cached stat data differs from what was last seen,
+    // the files git no longer tracks and whatever saw events meanwhile are
+    // looked at, all in one batch.
+    void reconcile_git(std::vector<std::string> paths) {
+        std::vector<GitIndex::Entry> entries;
+        if (GitIndex::read(git_dir + "/index", entries)) {
+            std::unordered_set<std::string> tracked;
+            std::unordered_set<std::string> dirs;
+            {
+                std::lock_guard<std::mutex> lock(stamp_mutex);
+                for (const auto& entry : entries) {
+                    std::string path = directory_path + "/" + entry.path;
+                    if (!is_source_path(path)) continue;
+                    auto it = known_files.find(path);
+                    if (it == known_files.end() || !entry.matches(it->second.stamp)) {
+                        paths.push_back(path);
+                        collect_parents(path, dirs);
+                    }
+                    tracked.insert(std::move(path));
+                }
+                for (const auto& [path, _] : known_files) {
+                    if (!tracked.count(path)) paths.push_back(path);
+                }
+            }
+            // The checkout may have created directories
+            for (const auto& dir : dirs) {
+                std::error_code ec;
+                if (!should_ignore(dir, true) && fs::is_directory(dir, ec)) add_watch(dir);
+            }
+        }
+        std::sort(paths.begin(), paths.end());
+        paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+        run_batch(std::move(paths));
+    }
+
+    // Catches up after the kernel dropped events. Directories whose mtime
+    // moved since they were last listed are listed again, for entries
+    // created or renamed into them, and every known file is stat'ed against
+    // its stamp; only what differs is parsed. Directories are never rescanned
+    // as a whole unless they are new.
+    void resync() {
+        std::vector<std::string> paths;
+        {
+            std::lock_guard<std::mutex> lock(stamp_mutex);
+            for (const auto& [path, _] : known_files) paths.push_back(path);
+        }
+        if (!git_dir.empty()) {
+            reconcile_git(std::move(paths));  // new files are whatever the index lists
+            return;
+        }
+
+        std::vector<std::pair<std::string, int64_t>> dirs;
+        {
+            std::lock_guard<std::mutex> lock(watch_mutex);
+            for (const auto& [dir, watched] : path_to_wd) dirs.emplace_back(dir, watched.mtime_ns);
+        }
+        for (const auto& [dir, mtime_ns] : dirs) {
+            struct stat st;
+            if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+                paths.push_back(dir);  // gone; the batch drops it
+                continue;
+            }
+            int64_t current = FileStamp::from_stat(st).mtime_ns;
+            if (current == mtime_ns) continue;
+            {
+                std::lock_guard<std::mutex> lock(watch_mutex);
+                auto it = path_to_wd.find(dir);
+                if (it != path_to_wd.end()) it->second.mtime_ns = current;
+            }
+
+            std::error_code ec;
+            TreeWalk::list(
+                dir,
+                [this](const std::string& path, bool is_dir) {
+                    return (!is_dir && !is_source_path(path)) || should_ignore(path, is_dir);
+                },
+                [&](std::string file) { paths.push_back(std::move(file)); },
+                [&](std::string sub) {
+                    {
+                        std::lock_guard<std::mutex> lock(watch_mutex);
+                        if (path_to_wd.count(sub)) return;
+                    }
+                    add_watch(sub);
+                    walk_tree(sub,
+                              [&](const std::string& file) {
+                                  if (is_source_path(file)) paths.push_back(file);
+                              },
+                              [&](const std::string& nested) { add_watch(nested); });
+                },
+                ec);
+        }
+
+        std::sort(paths.begin(), paths.end());
+        paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+        run_batch(std::move(paths));
+        report_watches();
+    }
+
+    // Directories created or moved in since their watches were added by the
+    // event loop: files may have landed before, and subdirectories, which
+    // need watches too. Walked here rather than on the loop, where a large
+    // tree (an unpacked archive) would hold up every repo's events.
+    void walk_new_dirs(const std::vector<std::string>& dirs) {
+        std::vector<std::string> paths;
+        for (const auto& dir : dirs) {
+            walk_tree(dir,
+                      [&](const std::string& file) {
+                          if (is_source_path(file)) paths.push_back(file);
+                      },
+                      [&](const std::string& sub) { add_watch(sub); });
+        }
+        std::sort(paths.begin(), paths.end());
+        paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+        run_batch(std::move(paths));
+    }
+
+    void process_ignore_file_change() {
+        load_ignore_patterns();
+
+        // Directories ignored now lose their watches and tags, one subtree
+        // at a time
+        std::vector<std::string> ignored_dirs;
+        {
+            std::lock_guard<std::mutex> lock(watch_mutex);
+            for (const auto& [dir, _] : path_to_wd) {
+                if (!ignored_dirs.empty() && dir.compare(0, ignored_dirs.back().size() + 1,
+                                                         ignored_dirs.back() + "/") == 0) {
+                    continue;  // inside a directory already dropped
+                }
+                if (dir != directory_path && should_ignore(dir, true)) ignored_dirs.push_back(dir);
+            }
+        }
+        for (const auto& dir : ignored_dirs) {
+            drop_subtree(dir);
+        }
+
+        // Files matched by the new patterns themselves lose their tags too
+        std::vector<std::string> now_ignored;
+        {
+            std::lock_guard<std::mutex> lock(stamp_mutex);
+            for (const auto& [filepath, _] : known_files) {
+                if (should_ignore(filepath)) now_ignored.push_back(filepath);
+            }
+        }
+        for (const auto& filepath : now_ignored) {
+            drop_subtree(filepath);
+        }
+
+        // Watch directories that are no longer ignored; files that are no
+        // longer ignored get their tags back and every other file is brought
+        // up to date, all in one batch
+        std::vector<std::string> files_to_process;
+        list_tree([&](const std::string& file) {
+                      if (is_source_path(file)) files_to_process.push_back(file);
+                  },
+                  [&](const std::string& dir) { add_watch(dir); });
+        process_batch(files_to_process);
+        report_watches();
+    }
+
+    void handle_event(const inotify_event& event) {
+        if (event.mask & IN_Q_OVERFLOW) {
+            if (!overflowed) {
+                std::cerr << "[FileWatcher] " << directory_path << ": inotify queue overflowed, resyncing" << std::endl;
+            }
+            overflowed = true;
+            metrics.overflows++;
+            return;
+        }
+        if (event.mask & IN_IGNORED) {
+            forget_watch(event.wd);
+            return;
+        }
+
+        std::string dir_path;
+        {
+            std::lock_guard<std::mutex> lock(watch_mutex);
+            auto wd_it = wd_to_path.find(event.wd);
+            if (wd_it == wd_to_path.end()) return;
+            dir_path = wd_it->second;
+        }
+        std::string full_path = event.len > 0 ? dir_path + "/" + event.name : dir_path;
+
+        if (!git_dir.empty() && (dir_path == git_dir || dir_path.compare(0, git_dir.size() + 1, git_dir + "/") == 0)) {
+            // HEAD, the index or a branch moved: git is at work, so hold the
+            // work tree's events until it's done
+            std::string_view name = event.len > 0 ? event.name : "";
+            if (dir_path != git_dir || name == "HEAD" || name == "index" || name == "index.lock" ||
+                name == "packed-refs") {
+                if (!git_pending) git_started_at = EventDebouncer::Clock::now();
+                git_pending = true;
+                git_event_at = EventDebouncer::Clock::now();
+            }
+            return;
+        }
+        if (git_pending) {
+            held.insert(full_path);
+            return;
+        }
+
+        if (Utils::is_temp_path(full_path)) return;  // our own ID stamping in progress
+
+        if (event.mask & IN_MOVED_FROM) {
+            // Until its IN_MOVED_TO shows up or on_tick gives up on it
+            moved_from[event.cookie] = PendingMove{full_path, (event.mask & IN_ISDIR) != 0,
+                                                   EventDebouncer::Clock::now()};
+        }
+        else if ((event.mask & IN_MOVED_TO) && pair_move(event.cookie, full_path)) {
+            // Re-rooted; nothing to parse
+        }
+        else if (full_path == ignore_file_path) {
+            debouncer.add(full_path);  // editors often write it in several steps
+        }
+        else if (event.mask & (IN_CREATE | IN_MOVED_TO) && (event.mask & IN_ISDIR)) {
+            if (!TreeWalk::enters(full_path) || should_ignore(full_path, true)) return;
+            add_watch(full_path);
+            new_dirs.push_back(full_path);  // walked by a job, see walk_new_dirs
+        }
+        else if (event.mask & (IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_DELETE)) {
+            debouncer.add(full_path);
+        }
+    }
+
+    // Matches an IN_MOVED_TO with its IN_MOVED_FROM and queues the rename as
+    // a re-root. Returns false if it can't be one, e.g. an editor saving by
+    // renaming a temp file over the original; the old path is then treated
+    // as deleted and to as created.
+    bool pair_move(uint32_t cookie, const std::string& to) {
+        auto it = moved_from.find(cookie);
+        if (it == moved_from.end()) return false;
+        PendingMove from = std::move(it->second);
+        moved_from.erase(it);
+
+        bool busy;
+        {
+            std::lock_guard<std::mutex> lock(job_mutex);
+            busy = job_running;
+        }
+        bool movable = !(busy && in_flight_unknown) && from.path != ignore_file_path && to != ignore_file_path &&
+                       !should_ignore(from.path, from.is_dir) && !should_ignore(to, from.is_dir);
+        if (from.is_dir) {
+            std::lock_guard<std::mutex> lock(watch_mutex);
+            movable = movable && path_to_wd.count(from.path);
+        } else {
+            movable = movable && is_source_path(from.path) && is_source_path(to);
+        }
+        if (!movable) {
+            debouncer.add(from.path);
+            return false;
+        }
+
+        if (from.is_dir) rewatch_subtree(from.path, to);
+        debouncer.move_subtree(from.path, to);
+        for (auto& dir : new_dirs) {
+            if (Utils::in_subtree(dir, from.path)) dir = to + dir.substr(from.path.size());
+        }
+        // The running batch may find these gone and drop them before the move
+        // is applied; have them looked at again under their new path
+        if (busy) {
+            for (const auto& path : in_flight) {
+                if (Utils::in_subtree(path, from.path)) debouncer.add(to + path.substr(from.path.size()));
+            }
+        }
+        paired_moves.emplace_back(std::move(from.path), to);
+        metrics.renames++;
+        return true;
+    }
+
+    void add_watch(const std::string& path) {
+        std::lock_guard<std::mutex> lock(watch_mutex);
+        if (path_to_wd.count(path)) return;
+        int wd = inotify_add_watch(inotify_fd, path.c_str(),
+                                   IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM);
+        if (wd < 0) {
+            if (errno == ENOSPC && !watch_limit_reported) {
+                watch_limit_reported = true;
+                std::cerr << "[FileWatcher] inotify watch limit reached in " << directory_path
+                          << " after " << wd_to_path.size()
+                          << " watches; raise fs.inotify.max_user_watches or ignore more directories." << std::endl;
+            }
+            return;
+        }
+
+        // Stat'ed after the watch is in place: any later change raises events
+        struct stat st;
+        int64_t mtime_ns = stat(path.c_str(), &st) == 0 ? FileStamp::from_stat(st).mtime_ns : 0;
+        wd_to_path[wd] = path;
+        path_to_wd[path] = WatchedDir{wd, mtime_ns};
+        watch_count = wd_to_path.size();
+    }
+
+    // Drops a watch the kernel removed on its own, e.g. with its directory.
+    void forget_watch(int wd) {
+        std::lock_guard<std::mutex> lock(watch_mutex);
+        auto it = wd_to_path.find(wd);
+        if (it == wd_to_path.end()) return;
+        auto dir = path_to_wd.find(it->second);
+        if (dir != path_to_wd.end() && dir->second.wd == wd) path_to_wd.erase(dir);
+        wd_to_path.erase(it);
+        watch_count = wd_to_path.size();
+    }
+
+    void report_watches() const {
+        std::cerr << "[FileWatcher] " << directory_path << ": watching " << watch_count << " directories" << std::endl;
+    }
+
+    // Runs job on the shared pool unless one is already running for this repo.
+    bool try_run_job(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(job_mutex);
+            if (job_running) return false;
+            job_running = true;
+        }
+        pool->submit([this, job = std::move(job)]() {
+            try {
+                job();
+            } catch (const std::exception& e) {
+                std::cerr << "[FileWatcher] " << directory_path << ": " << e.what() << std::endl;
+            }
+            // stop() may destroy the watcher as soon as job_running is
+            // seen false, so nothing on this is touched after the unlock
+            EventLoop* wake = loop;
+            {
+                std::lock_guard<std::mutex> lock(job_mutex);
+                job_running = false;
+                job_cv.notify_all();
+            }
+            if (wake) wake->wake();  // deadlines may have moved
+        });
+        return true;
+    }
+
+    void wait_for_job() {
+        std::unique_lock<std::mutex> lock(job_mutex);
+        job_cv.wait(lock, [this] { return !job_running; });
+    }
+
+    void on_readable() {
+        alignas(inotify_event) char buffer[32768];
+        while (true) {
+            ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+            if (len <= 0) return;
+            ScopedTimer timer(metrics.read_seconds);
+            metrics.inotify_reads++;
+            for (ssize_t i = 0; i < len;) {
+                auto* event = reinterpret_cast<inotify_event*>(&buffer[i]);
+                handle_event(*event);
+                metrics.events++;
+                i += sizeof(inotify_event) + event->len;
+            }
+        }
+    }
+
+    void run_batch(std::vector<std::string> ready) {
+        std::erase_if(ready, [this](const std::string& path) { return is_own_write(path); });
+        if (std::erase(ready, ignore_file_path) > 0) process_ignore_file_change();
+        if (!ready.empty()) process_batch(ready);
+
+        auto render_at = render_deadline();
+        if (render_at && *render_at <= std::chrono::steady_clock::now()) update_codetags_file();
+    }
+
+    // Hands due work to the pool; returns when the loop should call again.
+    std::optional<EventLoop::Clock::time_point> on_tick(EventLoop::Clock::time_point now) {
+        {
+            std::lock_guard<std::mutex> lock(job_mutex);
+            if (job_running) return std::nullopt;  // its completion wakes the loop
+        }
+
+        if (overflowed && try_run_job([this]() { resync(); })) {
+            overflowed = false;
+            in_flight_unknown = true;
+            return std::nullopt;
+        }
+        if (!new_dirs.empty() && try_run_job([this, dirs = new_dirs]() { walk_new_dirs(dirs); })) {
+            new_dirs.clear();
+            in_flight_unknown = true;
+            return std::nullopt;
+        }
+
+        // Reconcile once git is done: its lock file is gone and .git has been
+        // quiet for a debounce interval (or a lock file was left behind)
+        std::optional<EventLoop::Clock::time_point> git_at;
+        if (git_pending) {
+            std::error_code ec;
+            if (fs::exists(git_dir + "/index.lock", ec) && now - git_started_at < std::chrono::seconds(30)) {
+                git_event_at = now;
+            }
+            git_at = git_event_at + config.debounce;
+            if (*git_at <= now) {
+                std::vector<std::string> paths(held.begin(), held.end());
+                if (try_run_job([this, paths]() { reconcile_git(paths); })) {
+                    in_flight_unknown = true;
+                    git_pending = false;
+                    held.clear();
+                    return std::nullopt;
+                }
+            }
+        }
+
+        // A rename whose other half never came was a move out of the tree
+        std::optional<EventLoop::Clock::time_point> move_at;
+        for (auto it = moved_from.begin(); it != moved_from.end();) {
+            auto expires = it->second.at + move_timeout;
+            if (expires <= now) {
+                debouncer.add(it->second.path, now);
+                it = moved_from.erase(it);
+                continue;
+            }
+            if (!move_at || expires < *move_at) move_at = expires;
+            ++it;
+        }
+
+        auto render_at = render_deadline();
+        auto ready = debouncer.take_ready(now);
+        if (!ready.empty() || !paired_moves.empty() || (render_at && *render_at <= now)) {
+            auto job = [this, ready, moves = paired_moves]() {
+                for (const auto& [from, to] : moves) apply_move(from, to);
+                run_batch(ready);
+            };
+            if (try_run_job(job)) {
+                paired_moves.clear();
+                in_flight_unknown = std::find(ready.begin(), ready.end(), ignore_file_path) != ready.end();
+                in_flight = std::move(ready);
+                return std::nullopt;
+            }
+            for (const auto& path : ready) debouncer.add(path, now - config.debounce);
+        }
+
+        auto next = debouncer.next_deadline();
+        if (render_at && (!next || *render_at < *next)) next = render_at;
+        if (git_at && (!next || *git_at < *next)) next = git_at;
+        if (move_at && (!next || *move_at < *next)) next = move_at;
+        return next;
+    }
+
+public:
+    // With an index_dir, parse results are persisted there across restarts.
+    FileWatcher(const std::string& dir_path, std::shared_ptr<TagDatabase> db,
+                std::shared_ptr<ThreadPool> worker_pool, EventLoop* event_loop,
+                const Config& cfg, const std::string& index_dir = "")
+        : directory_path(dir_path),
+          ignore_file_path(dir_path + "/.ctagsignore"),
+          loop(event_loop),
+          debouncer(cfg.debounce),
+          renderer(dir_path, cfg.outputs),
+          tag_db(db),
+          pool(worker_pool),
+          matcher(TagMatcher::load(dir_path + "/.ctagstypes")),
+          config(cfg) {
+        if (!index_dir.empty()) index = std::make_unique<TagIndex>(index_dir, dir_path);
+        if (cfg.git_index) git_dir = GitIndex::find_git_dir(dir_path);
+        load_ignore_patterns();
+    }  
+
+    ~FileWatcher() {
+        stop();
+    }
+
+    // Starts following the tree. The startup walk and scan run as a job on
+    // the pool; events that arrive meanwhile queue up in the debouncer.
+    void start() {
+        if (running) return;
+
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0) {
+            std::cerr << "[FileWatcher] Failed to initialize inotify." << std::endl;
+            return;
+        }
+        running = true;
+
+        {
+            std::lock_guard<std::mutex> lock(stamp_mutex);
+            known_files.clear();
+            own_writes.clear();
+        }
+
+        if (loop) {
+            loop->add(inotify_fd, [this] { on_readable(); },
+                      [this](EventLoop::Clock::time_point now) { return on_tick(now); });
+        }
+
+        in_flight_unknown = true;
+        try_run_job([this]() {
+            // One walk both places the watches and lists the files to scan
+            std::vector<std::string> files;
+            add_watch(directory_path);
+            if (!git_dir.empty()) {
+                add_watch(git_dir);
+                add_watch(git_dir + "/refs/heads");
+            }
+            list_tree([&](const std::string& file) {
+                          if (is_source_path(file)) files.push_back(file);
+                      },
+                      [&](const std::string& dir) { add_watch(dir); });
+            report_watches();
+            initial_scan(std::move(files));
+        });
+    }
+
+    size_t get_watch_count() const { return watch_count; }
+
+    // Adds this repo's samples. Call on the loop thread: the pending events
+    // are only touched there.
+    void write_metrics(MetricsText& out, const std::string& labels) {
+        const auto& m = metrics;
+        out.counter("codetags_inotify_reads_total", "Reads of the inotify descriptor.", labels, m.inotify_reads);
+        out.counter("codetags_inotify_events_total", "inotify events handled.", labels, m.events);
+        out.counter("codetags_inotify_overflows_total", "Kernel event queue overflows, each followed by a resync.",
+                    labels, m.overflows);
+        out.counter("codetags_renames_total", "Renames applied without reparsing.", labels, m.renames);
+        out.counter("codetags_batches_total", "Batches of changed paths processed.", labels, m.batches);
+        out.counter("codetags_batch_paths_total", "Paths in those batches.", labels, m.batch_paths);
+        out.counter("codetags_files_parsed_total", "Files read and parsed.", labels, m.files_parsed);
+        out.counter("codetags_files_unchanged_total", "Files skipped because their stamp had not changed.", labels,
+                    m.files_unchanged);
+        out.counter("codetags_files_reused_total", "Files whose tags came from the index at startup.", labels,
+                    m.files_reused);
+        out.counter("codetags_files_stamped_total", "Files rewritten to add tag IDs.", labels, m.files_stamped);
+        std::string by_reason = labels.empty() ? "" : labels + ",";
+        out.counter("codetags_files_skipped_total", "Files not parsed: over --max-file-kb, or binary.",
+                    by_reason + MetricsText::label("reason", "size"), m.files_skipped_large);
+        out.counter("codetags_files_skipped_total", "Files not parsed: over --max-file-kb, or binary.",
+                    by_reason + MetricsText::label("reason", "binary"), m.files_skipped_binary);
+        out.counter("codetags_long_lines_total", "Lines not searched for being over --max-line-kb.", labels,
+                    m.long_lines);
+        out.counter("codetags_ids_restamped_total", "Tag IDs replaced because another tag had them, e.g. in a copy.",
+                    labels, m.ids_restamped);
+        out.counter("codetags_renders_total", "Updates of codetags.md.", labels, m.renders);
+        out.counter("codetags_render_writes_total", "Updates that changed and wrote codetags.md.", labels,
+                    m.render_writes);
+        out.histogram("codetags_inotify_read_seconds", "Time to handle one read of inotify events.", labels,
+                      m.read_seconds);
+        out.histogram("codetags_batch_seconds", "Time to bring one batch of changed paths up to date.", labels,
+                      m.batch_seconds);
+        out.histogram("codetags_parse_seconds", "Time to parse one file.", labels, m.parse_seconds);
+        out.histogram("codetags_render_seconds", "Time to update codetags.md.", labels, m.render_seconds);
+
+        out.gauge("codetags_watches", "Directories watched.", labels, static_cast<double>(watch_count));
+        {
+            std::lock_guard<std::mutex> lock(watch_mutex);
+            out.gauge("codetags_watch_limit_reached", "1 if inotify_add_watch hit fs.inotify.max_user_watches.",
+                      labels, watch_limit_reported ? 1 : 0);
+        }
+        auto oldest = debouncer.next_deadline();
+        double lag = oldest ? std::chrono::duration<double>(EventDebouncer::Clock::now() -
+                                                            (*oldest - config.debounce)).count()
+                            : 0;
+        out.gauge("codetags_pending_paths", "Paths with events waiting to be processed.", labels,
+                  static_cast<double>(debouncer.size() + held.size()));
+        out.gauge("codetags_pending_oldest_seconds", "Age of the oldest unprocessed event.", labels,
+                  std::max(lag, 0.0));
+        {
+            std::lock_guard<std::mutex> lock(job_mutex);
+            out.gauge("codetags_job_running", "1 while a scan or batch is running.", labels, job_running ? 1 : 0);
+        }
+
+        size_t files = 0, tags = 0, bytes = 0;
+        tag_db->snapshot().for_each_file([&](const FileTags& file) {
+            files++;
+            tags += file.tags.size();
+            bytes += sizeof(FileTags) + file.file_path.capacity() + file.text.capacity() +
+                     file.tags.capacity() * sizeof(Tag);
+        });
+        size_t known = 0;
+        {
+            std::lock_guard<std::mutex> lock(stamp_mutex);
+            known = known_files.size();
+            for (const auto& [path, _] : known_files) bytes += sizeof(path) + path.capacity() + sizeof(KnownFile) + 32;
+        }
+        out.gauge("codetags_files_known", "Source files tracked.", labels, static_cast<double>(known));
+        out.gauge("codetags_files_with_tags", "Files holding at least one tag.", labels, static_cast<double>(files));
+        out.gauge("codetags_tags", "Tags in the database.", labels, static_cast<double>(tags));
+        out.gauge("codetags_memory_bytes", "Estimated heap held by the repo's tags and file stamps.", labels,
+                  static_cast<double>(bytes));
+    }
+
+    void stop() {
+        if (!running) return;
+        running = false;
+
+        if (loop) loop->remove(inotify_fd);
+        wait_for_job();
+        if (render_deadline()) update_codetags_file();
+
+        {
+            std::lock_guard<std::mutex> lock(watch_mutex);
+            wd_to_path.clear();
+            path_to_wd.clear();
+            watch_count = 0;
+        }
+        close(inotify_fd);
+        inotify_fd = -1;
+        compact_index();
+    }
+};
+
+// ======================
+// QueryServer
+// ======================
+
+// One request against the daemon's databases. On the wire it is a single
+// line, "query key=value&key=value", values percent-encoded.
+struct TagQuery {
+    std::string repo;    // repo name; if empty, the repo holding dir, or every repo
+    std::string dir;
+    std::string type;
+    std::string file;    // relative to the repo root
+    std::string prefix;  // relative path prefix, e.g. "src/net/"
+    std::string id;
+    size_t offset = 0;
+    size_t limit = 100;
+    std::optional<uint64_t> since;  // subscriptions: resume after this sequence number
+    uint64_t epoch = 0;             // ... of the feed with this epoch
+
+    static constexpr size_t max_limit = 1000;
+
+    std::string encode() const {
+        std::string out;
+        auto field = [&](const char* key, const std::string& value) {
+            if (value.empty()) return;
+            out += (out.empty() ? "" : "&") + std::string(key) + "=" + Utils::url_encode(value);
+        };
+        field("repo", repo);
+        field("dir", dir);
+        field("type", type);
+        field("file", file);
+        field("prefix", prefix);
+        field("id", id);
+        field("offset", std::to_string(offset));
+        field("limit", std::to_string(limit));
+        if (since) field("since", std::to_string(*since));
+        if (epoch) field("epoch", std::to_string(epoch));
+        return out;
+    }
+
+    static bool decode(std::string_view text, TagQuery& query, std::string& error) {
+        while (!text.empty()) {
+            size_t amp = text.find('&');
+            std::string_view pair = text.substr(0, amp);
+            text = amp == std::string_view::npos ? std::string_view{} : text.substr(amp + 1);
+            if (pair.empty()) continue;
+
+            size_t eq = pair.find('=');
+            std::string key(pair.substr(0, eq));
+            std::string value = eq == std::string_view::npos ? "" : Utils::url_decode(pair.substr(eq + 1));
+            try {
+                if (key == "repo") query.repo = value;
+                else if (key == "dir") query.dir = value;
+                else if (key == "type") query.type = value;
+                else if (key == "file") query.file = value;
+                else if (key == "prefix") query.prefix = value;
+                else if (key == "id") query.id = value;
+                else if (key == "offset") query.offset = std::stoul(value);
+                else if (key == "limit") query.limit = std::min(std::stoul(value), max_limit);
+                else if (key == "since") query.since = std::stoull(value);
+                else if (key == "epoch") query.epoch = std::stoull(value);
+                else {
+                    error = "unknown field: " + key;
+                    return false;
+                }
+            } catch (const std::exception&) {
+                error = "invalid value for " + key + ": " + value;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Parses the options of `codetags query`, starting at argv[first].
+    static bool parse_args(int argc, char* argv[], int first, TagQuery& query, bool& all_repos) {
+        for (int i = first; i < argc; ++i) {
+            std::string arg = argv[i];
+            std::string value;
+            size_t eq = arg.find('=');
+            if (eq != std::string::npos) {
+                value = arg.substr(eq + 1);
+                arg = arg.substr(0, eq);
+            } else if (arg != "--all" && i + 1 < argc) {
+                value = argv[++i];
+            }
+
+            try {
+                if (arg == "--all") all_repos = true;
+                else if (arg == "--repo") query.repo = value;
+                else if (arg == "--type") query.type = value;
+                else if (arg == "--file") query.file = value;
+                else if (arg == "--prefix") query.prefix = value;
+                else if (arg == "--id") query.id = value;
+                else if (arg == "--offset") query.offset = std::stoul(value);
+                else if (arg == "--limit") query.limit = std::stoul(value);
+                else if (arg == "--since") query.since = std::stoull(value);
+                else if (arg == "--epoch") query.epoch = std::stoull(value);
+                else {
+                    std::cerr << "Unknown option: " << arg << "\n";
+                    return false;
+                }
+            } catch (const std::exception&) {
+                std::cerr << "Invalid value for " << arg << ": " << value << "\n";
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Recent tag changes of every repo, numbered in the order they were made.
+// A subscriber can resume from a sequence number for as long as the feed
+// still holds the events after it; the epoch tells the numbers of one daemon
+// run from another's.
+class ChangeFeed {
+public:
+    struct Event {
+        uint64_t seq;
+        std::string repo;
+        uint16_t type;
+        std::string json;  // one line, without the newline
+    };
+
+    static constexpr size_t capacity = 16384;
+
+private:
+    mutable std::mutex feed_mutex;
+    std::deque<Event> events;
+    uint64_t last_seq = 0;
+    uint64_t epoch_id;
+    std::function<void()> on_publish;
+
+    static const char* kind_name(TagChange::Kind kind) {
+        switch (kind) {
+        case TagChange::ADDED: return "added";
+        case TagChange::REMOVED: return "removed";
+        case TagChange::MOVED: return "moved";
+        case TagChange::CHANGED: return "changed";
+        }
+        return "";
+    }
+
+    static std::string describe(const std::string& repo, const TagChange& change) {
+        std::string out = ",\"repo\":\"" + Utils::json_escape(repo) + "\"";
+        out += ",\"event\":\"" + std::string(kind_name(change.kind)) + "\"";
+        out += ",\"id\":\"" + Tag::format_id(change.tag->id) + "\"";
+        out += ",\"type\":\"" + Utils::json_escape(TagTypes::name(change.tag->type)) + "\"";
+        out += ",\"file\":\"" + Utils::json_escape(change.file->relative_path()) + "\"";
+        out += ",\"line\":" + std::to_string(change.tag->line_number);
+        out += ",\"content\":\"" + Utils::json_escape(change.file->content(*change.tag)) + "\"";
+        if (change.old_tag) {
+            if (change.old_file->file_path != change.file->file_path) {
+                out += ",\"old_file\":\"" + Utils::json_escape(change.old_file->relative_path()) + "\"";
+            }
+            if (change.old_tag->line_number != change.tag->line_number) {
+                out += ",\"old_line\":" + std::to_string(change.old_tag->line_number);
+            }
+            if (change.old_tag->type != change.tag->type) {
+                out += ",\"old_type\":\"" + Utils::json_escape(TagTypes::name(change.old_tag->type)) + "\"";
+            }
+            if (change.old_file->content(*change.old_tag) != change.file->content(*change.tag)) {
+                out += ",\"old_content\":\"" + Utils::json_escape(change.old_file->content(*change.old_tag)) + "\"";
+            }
+        }
+        return out + "}";
+    }
+
+public:
+    ChangeFeed()
+        : epoch_id(static_cast<uint64_t>(std::chrono::system_clock::now().time_since_epoch().count())) {}
+
+    // Called after each publish, from whichever thread published.
+    void set_notify(std::function<void()> notify) {
+        on_publish = std::move(notify);
+    }
+
+    uint64_t epoch() const { return epoch_id; }
+
+    uint64_t last() const {
+        std::lock_guard<std::mutex> lock(feed_mutex);
+        return last_seq;
+    }
+
+    void publish(const std::string& repo, const std::vector<TagChange>& changes) {
+        std::vector<std::string> bodies;
+        bodies.reserve(changes.size());
+        for (const auto& change : changes) bodies.push_back(describe(repo, change));
+        {
+            std::lock_guard<std::mutex> lock(feed_mutex);
+            for (size_t i = 0; i < changes.size(); ++i) {
+                ++last_seq;
+                events.push_back(Event{last_seq, repo, changes[i].tag->type,
+                                       "{\"seq\":" + std::to_string(last_seq) + bodies[i]});
+            }
+            while (events.size() > capacity) events.pop_front();
+        }
+        if (on_publish) on_publish();
     }
 
-    bool is_source_file(const std::string& ext) const {
-        return ext == ".cpp" || ext == ".h" || ext == ".hpp" || ext == ".c" ||
-               ext == ".java" || ext == ".js" || ext == ".ts" || ext == ".py" ||
-               ext == ".rb" || ext == ".go" || ext == ".rs" || ext == ".php";
+    // Copies up to max events after seq. Returns false if some of them were
+    // already dropped, or seq is not one this feed handed out.
+    bool read_since(uint64_t seq, std::vector<Event>& out, size_t max) const {
+        std::lock_guard<std::mutex> lock(feed_mutex);
+        if (seq > last_seq) return false;
+        if (seq == last_seq) return true;
+        if (events.empty() || seq + 1 < events.front().seq) return false;
+        for (size_t i = seq + 1 - events.front().seq; i < events.size() && out.size() < max; ++i) {
+            out.push_back(events[i]);
+        }
+        return true;
     }
 };
 
-// ======================
-// FileWatcher
-// ======================
+// Answers queries on a Unix socket straight from the in-memory databases.
+// Connections are served on the event loop; each request line gets one JSON
+// line back, and a client may send as many requests as it likes. A
+// "subscribe" request instead turns the connection into a stream of the
+// feed's events, one JSON line each.
+class QueryServer {
+public:
+    struct Repo {
+        std::string name;
+        std::string path;
+        std::shared_ptr<TagDatabase> db;
+    };
+    using RepoList = std::function<std::vector<Repo>()>;
+    using StatsWriter = std::function<void(MetricsText& out, const std::string& repo)>;  // repo empty for all
 
-class FileWatcher {
 private:
-    std::string directory_path;
-    std::string ignore_file_path;
-    std::atomic<bool> running{false};
-    std::thread watcher_thread;
-    int inotify_fd{-1};
-    mutable std::mutex ignore_patterns_mutex;
-    std::vector<std::string> ignore_patterns;
-    std::string codetags_file;
-    std::shared_ptr<TagDatabase> tag_db;  // Each repo has its own database
+    struct Client {
+        std::string input;
+        bool subscribed = false;
+        std::set<std::string> repos;    // subscriptions: repos to stream, empty for all
+        std::string type_name;          // ... and the one type, if filtered
+        std::optional<uint16_t> type;   // type_name's, once some repo has seen it
+        uint64_t cursor = 0;            // last feed event looked at
+        std::string output;             // not yet sent
+        bool waiting = false;           // for the socket to take output
+    };
 
-    std::unordered_map<std::string, time_t> last_known_mtime;
-    std::unordered_set<std::string> currently_ignored_files;
-    std::unordered_map<int, std::string> wd_to_path;
-    std::unordered_map<std::string, int> path_to_wd;
+    static constexpr size_t max_request = 64 * 1024;
+    static constexpr size_t max_backlog = 4 << 20;  // unsent bytes before a client is dropped
 
-    void load_ignore_patterns() {
-        std::lock_guard<std::mutex> lock(ignore_patterns_mutex);
-        ignore_patterns.clear();
-        if (!Utils::file_exists(ignore_file_path)) return;
-        std::ifstream file(ignore_file_path);
-        std::string line;
-        while (std::getline(file, line)) {
-            if (!line.empty() && line[0] != '#' && line[0] != ' ') {
-                ignore_patterns.push_back(line);
-            }
-        }
+    std::string socket_path;
+    EventLoop* loop;
+    RepoList list_repos;
+    ChangeFeed* feed;
+    StatsWriter write_stats;
+    int listen_fd = -1;
+    int timer_key = 0;
+    std::unordered_map<int, Client> clients;  // touched on the loop thread only
+
+    static std::string error_json(const std::string& message) {
+        return "{\"error\":\"" + Utils::json_escape(message) + "\"}";
     }
 
-    bool should_ignore(const std::string& path) const {
-        std::lock_guard<std::mutex> lock(ignore_patterns_mutex);
-        
-        std::string rel_path;
-        if (path.length() > directory_path.length() && 
-            path.substr(0, directory_path.length()) == directory_path &&
-            path[directory_path.length()] == '/') {
-            rel_path = path.substr(directory_path.length() + 1);
-        } else if (path == directory_path) {
-            return false;
-        } else {
-            rel_path = path;
-        }
-        
-        if (rel_path.empty()) return false;
-        
-        for (const auto& pattern : ignore_patterns) {
-            if (pattern.empty() || pattern[0] == '#') continue;
-            
-            std::string actual_pattern = pattern;
-            bool match_dirs_only = false;
-            
-            if (!actual_pattern.empty() && actual_pattern.back() == '/') {
-                match_dirs_only = true;
-                actual_pattern.pop_back();
-            }
-            
-            bool anchored = false;
-            if (!actual_pattern.empty() && actual_pattern[0] == '/') {
-                anchored = true;
-                actual_pattern = actual_pattern.substr(1);
-            }
-            
-            std::vector<std::string> paths_to_check;
-            paths_to_check.push_back(rel_path);
-            
-            std::string temp = rel_path;
-            while (!temp.empty()) {
-                size_t last_slash = temp.find_last_of('/');
-                if (last_slash == std::string::npos) break;
-                temp = temp.substr(0, last_slash);
-                paths_to_check.push_back(temp + "/");
-            }
-            
-            for (const auto& check_path : paths_to_check) {
-                std::string clean_check = check_path;
-                if (clean_check.back() == '/') clean_check.pop_back();
-                
-                if (fnmatch(actual_pattern.c_str(), clean_check.c_str(), FNM_PATHNAME) == 0) {
-                    if (match_dirs_only && check_path.back() != '/') {
-                        continue;
-                    }
-                    return true;
-                }
-                
-                if (!anchored) {
-                    std::string wildcard_pattern = "*" + actual_pattern;
-                    if (fnmatch(wildcard_pattern.c_str(), clean_check.c_str(), FNM_PATHNAME) == 0) {
-                        if (match_dirs_only && check_path.back() != '/') {
-                            continue;
-                        }
-                        return true;
-                    }
-                }
+    // Writes everything, waiting up to a second for a slow reader. Only for
+    // the command line's side of the socket: the daemon never blocks on it.
+    static bool write_all(int fd, const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                sent += static_cast<size_t>(n);
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && errno == EAGAIN) {
+                pollfd pfd{fd, POLLOUT, 0};
+                if (poll(&pfd, 1, 1000) <= 0) return false;
+            } else {
+                return false;
             }
         }
-        return false;
+        return true;
     }
 
-    void update_codetags_file() {
-        auto all_tags = tag_db->get_all_tags();  // Get only this repo's tags
-        try {
-            std::ofstream file(codetags_file);
-            file << "# Codetags\n";
-            std::map<std::string, std::vector<Tag>> grouped;
-            for (const auto& tag : all_tags) grouped[tag.type].push_back(tag);
-            for (const auto& [type, vec] : grouped) {
-                file << "## " << type << "\n";
-                for (const auto& tag : vec) {
-                    file << "- **[" << tag.id << "]** " << tag.content << "\n";
-                    file << "  - *File:* " << tag.relative_path << ":" << tag.line_number << "\n";
-                    file << "  - *Modified:* " << Utils::format_time(tag.last_modified) << "\n";
+    // Picks the repos a request is about: by name, the one holding dir (the
+    // innermost, for nested repos), or all of them.
+    static std::vector<const Repo*> select_repos(const TagQuery& query, const std::vector<Repo>& repos) {
+        std::vector<const Repo*> selected;
+        for (const auto& repo : repos) {
+            if (!query.repo.empty()) {
+                if (repo.name == query.repo) selected.push_back(&repo);
+            } else if (!query.dir.empty()) {
+                bool inside = query.dir == repo.path || (query.dir.size() > repo.path.size() &&
+                              query.dir.compare(0, repo.path.size(), repo.path) == 0 &&
+                              query.dir[repo.path.size()] == '/');
+                if (inside && (selected.empty() || repo.path.size() > selected[0]->path.size())) {
+                    selected.assign(1, &repo);
                 }
+            } else {
+                selected.push_back(&repo);
             }
-        } catch (...) {}
+        }
+        return selected;
     }
 
-    void process_file_event(const std::string& filepath) {
-        if (should_ignore(filepath)) {
-            tag_db->remove_tags_in_file(filepath);
-            update_codetags_file();
-            last_known_mtime.erase(filepath);
-            return;
+    std::string subscribe(int fd, const TagQuery& query) {
+        Client& client = clients[fd];
+        if (!query.repo.empty() || !query.dir.empty()) {
+            auto repos = list_repos();
+            auto selected = select_repos(query, repos);
+            if (selected.empty()) {
+                return error_json("no registered repository matches " + (query.repo.empty() ? query.dir : query.repo));
+            }
+            for (const Repo* repo : selected) client.repos.insert(repo->name);
         }
+        // Types are only looked up: interning what clients send would grow
+        // the registry without bound
+        client.type_name = query.type;
 
-        fs::path p(filepath);
-        if (!p.has_extension()) {
-            return;
-        }
-        std::string ext = p.extension().string();
-        TagParser parser;
-        if (!parser.is_source_file(ext)) {
-             return;
+        // Resume where the client left off if the feed still has everything
+        // since then; otherwise it has to start over from a fresh query
+        bool reset = false;
+        std::vector<ChangeFeed::Event> probe;
+        if (query.since && query.epoch == feed->epoch() && feed->read_since(*query.since, probe, 0)) {
+            client.cursor = *query.since;
+        } else {
+            client.cursor = feed->last();
+            reset = query.since.has_value();
         }
+        client.subscribed = true;
+        return "{\"subscribed\":true,\"epoch\":" + std::to_string(feed->epoch()) +
+               ",\"seq\":" + std::to_string(client.cursor) + ",\"reset\":" + (reset ? "true" : "false") + "}";
+    }
 
-        struct stat st;
-        if (stat(filepath.c_str(), &st) != 0) {
-            tag_db->remove_tags_in_file(filepath);
-            update_codetags_file();
-            last_known_mtime.erase(filepath);
-            return;
+    // Sends what the socket takes without blocking; the rest goes once it is
+    // writable again. Returns false if the client is gone, or has let more
+    // than max_backlog pile up.
+    bool flush(int fd, Client& client) {
+        while (!client.output.empty()) {
+            ssize_t n = send(fd, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+            if (n > 0) {
+                client.output.erase(0, static_cast<size_t>(n));
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && errno == EAGAIN) {
+                break;
+            } else {
+                return false;
+            }
         }
-
-        auto it = last_known_mtime.find(filepath);
-        if (it != last_known_mtime.end() && it->second == st.st_mtime) {
-            return;
+        bool waiting = !client.output.empty();
+        if (waiting != client.waiting) {
+            client.waiting = waiting;
+            loop->set_writable(fd, waiting ? std::function<void()>([this, fd] { on_writable(fd); }) : nullptr);
         }
+        return client.output.size() <= max_backlog;
+    }
 
-        last_known_mtime[filepath] = st.st_mtime;
-
-        auto new_tags = parser.parse_file(filepath, directory_path, st.st_mtime);
-        auto old_ids = tag_db->get_tag_ids_in_file(filepath);
+    void on_writable(int fd) {
+        auto it = clients.find(fd);
+        if (it == clients.end()) return;
+        Client& client = it->second;
+        if (!(client.subscribed ? pump(fd, client) : flush(fd, client))) close_client(fd);
+    }
 
-        for (const auto& id : old_ids) {
-            tag_db->remove_tag(id);
+    // Queues the feed events a subscriber hasn't seen and sends what the
+    // socket takes. Returns false if the client is gone.
+    bool pump(int fd, Client& client) {
+        if (!client.type_name.empty() && !client.type) client.type = TagTypes::find(client.type_name);
+        std::vector<ChangeFeed::Event> events;
+        while (client.output.size() < max_backlog) {
+            events.clear();
+            if (!feed->read_since(client.cursor, events, 1024)) {
+                // Fell too far behind: the client has to start over
+                client.cursor = feed->last();
+                client.output += "{\"reset\":true,\"seq\":" + std::to_string(client.cursor) + "}\n";
+                break;
+            }
+            if (events.empty()) break;
+            for (const auto& event : events) {
+                if ((client.repos.empty() || client.repos.count(event.repo)) &&
+                    (client.type_name.empty() || client.type == event.type)) {
+                    client.output += event.json;
+                    client.output += '\n';
+                }
+            }
+            client.cursor = events.back().seq;
         }
+        return flush(fd, client);
+    }
 
-        for (const auto& tag : new_tags) {
-            tag_db->add_tag(tag);
+    std::optional<EventLoop::Clock::time_point> on_tick(EventLoop::Clock::time_point) {
+        std::vector<int> gone;
+        for (auto& [fd, client] : clients) {
+            if (client.subscribed && !pump(fd, client)) gone.push_back(fd);
         }
+        for (int fd : gone) close_client(fd);
+        return std::nullopt;
+    }
 
-        update_codetags_file();
+    void close_client(int fd) {
+        loop->remove(fd);
+        close(fd);
+        clients.erase(fd);
     }
 
-    void process_ignore_file_change() {
-        load_ignore_patterns();
-        
-        std::unordered_set<std::string> new_ignored_files;
-        std::vector<std::string> files_to_process;
-        
-        try {
-            for (const auto& entry : fs::recursive_directory_iterator(directory_path)) {
-                if (entry.is_regular_file()) {
-                    std::string filepath = entry.path().string();
-                    if (should_ignore(filepath)) {
-                        new_ignored_files.insert(filepath);
-                    } else {
-                        files_to_process.push_back(filepath);
-                    }
-                }
-            }
-        } catch (const fs::filesystem_error& e) {
-            return;
+    void on_accept() {
+        while (true) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            clients[fd] = Client{};
+            loop->add(fd, [this, fd] { on_client(fd); });
         }
-        
-        // Find files that are newly ignored
-        for (const auto& filepath : new_ignored_files) {
-            if (currently_ignored_files.find(filepath) == currently_ignored_files.end()) {
-                // Newly ignored - remove tags
-                tag_db->remove_tags_in_file(filepath);
-                last_known_mtime.erase(filepath);
+    }
+
+    // Answers the complete requests in client's input. False if what is
+    // left, a request still coming, is already over max_request.
+    bool take_requests(int fd, Client& client) {
+        std::string& input = client.input;
+        // Replies are queued, never waited on: a client that doesn't read
+        // them is dropped once they pass max_backlog
+        size_t start = 0, newline;
+        while ((newline = input.find('\n', start)) != std::string::npos) {
+            client.output += handle(fd, std::string_view(input).substr(start, newline - start));
+            client.output += '\n';
+            start = newline + 1;
+            if (client.subscribed) {
+                input.clear();
+                loop->wake();  // stream the backlog from the next tick
+                return true;
             }
         }
-        
-        // Find files that are no longer ignored
-        for (const auto& filepath : currently_ignored_files) {
-            if (new_ignored_files.find(filepath) == new_ignored_files.end()) {
-                // No longer ignored - add tags back by processing the file
-                process_file_event(filepath);
+        input.erase(0, std::min(start, input.size()));
+        return input.size() <= max_request;
+    }
+
+    void on_client(int fd) {
+        auto it = clients.find(fd);
+        if (it == clients.end()) return;
+        Client& client = it->second;
+        char buffer[4096];
+        while (true) {
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n > 0) {
+                if (client.subscribed) continue;  // a subscription only streams
+                client.input.append(buffer, static_cast<size_t>(n));
+                if (!take_requests(fd, client) || !flush(fd, client)) {
+                    close_client(fd);
+                    return;
+                }
+                continue;
             }
-        }
-        
-        // Process all non-ignored files to make sure they're up to date
-        for (const auto& filepath : files_to_process) {
-            // Only process if not already handled above
-            if (currently_ignored_files.count(filepath) == 0) {
-                process_file_event(filepath);
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0 || errno != EAGAIN) {
+                close_client(fd);
+                return;
             }
+            break;
         }
-        
-        // Update our tracking set
-        currently_ignored_files = std::move(new_ignored_files);
-        update_codetags_file();
     }
 
+public:
+    QueryServer(std::string path, EventLoop* event_loop, RepoList repos, ChangeFeed* change_feed,
+                StatsWriter stats = nullptr)
+        : socket_path(std::move(path)),
+          loop(event_loop),
+          list_repos(std::move(repos)),
+          feed(change_feed),
+          write_stats(std::move(stats)) {}
 
+    ~QueryServer() {
+        stop();
+    }
 
-    void add_watch_recursive(const std::string& path) {
-        int wd = inotify_add_watch(inotify_fd, path.c_str(),
-                                   IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM);
-        
-        if (wd < 0) {
-            return;
+    bool start() {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(addr.sun_path)) {
+            std::cerr << "[QueryServer] Socket path too long: " << socket_path << std::endl;
+            return false;
         }
-        
-        wd_to_path[wd] = path;
-        path_to_wd[path] = wd;
+        std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
 
-        try {
-            for (const auto& entry : fs::directory_iterator(path)) {
-                if (entry.is_directory()) {
-                    add_watch_recursive(entry.path().string());
-                }
-            }
-        } catch (const fs::filesystem_error& e) {
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) return false;
+        unlink(socket_path.c_str());  // left over from a daemon that did not shut down
+        mode_t old_mask = umask(0077);
+        bool bound = bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+        umask(old_mask);
+        if (!bound || listen(listen_fd, 64) != 0) {
+            std::cerr << "[QueryServer] Failed to listen on " << socket_path << ": " << std::strerror(errno) << std::endl;
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
         }
+        loop->add(listen_fd, [this] { on_accept(); });
+        timer_key = loop->add(-1, nullptr, [this](EventLoop::Clock::time_point now) { return on_tick(now); });
+        return true;
     }
 
-public:
-    FileWatcher(const std::string& dir_path, std::shared_ptr<TagDatabase> db)
-        : directory_path(dir_path),
-          ignore_file_path(dir_path + "/.ctagsignore"),
-          codetags_file(dir_path + "/codetags.md"),
-          tag_db(db) {
-        load_ignore_patterns();
-    }  
-
-    ~FileWatcher() {
-        stop();
+    void stop() {
+        if (listen_fd < 0) return;
+        loop->remove(listen_fd);
+        loop->remove(timer_key);
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(socket_path.c_str());
+        for (const auto& [fd, _] : clients) {
+            loop->remove(fd);
+            close(fd);
+        }
+        clients.clear();
     }
 
-    void start() {
-        if (running) return;
-        running = true;
+    // Answers one request line with one line of JSON, or for "stats" with
+    // Prometheus text closed by an "# EOF" line.
+    std::string handle(int fd, std::string_view line) {
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        size_t space = line.find(' ');
+        std::string_view command = line.substr(0, space);
+        std::string_view args = space == std::string_view::npos ? std::string_view{} : line.substr(space + 1);
 
-        inotify_fd = inotify_init1(IN_NONBLOCK);
-        if (inotify_fd < 0) {
-            std::cerr << "[FileWatcher] Failed to initialize inotify." << std::endl;
-            running = false;
-            return;
+        if (command == "query") {
+            TagQuery query;
+            std::string error;
+            if (!TagQuery::decode(args, query, error)) return error_json(error);
+            return answer(query, list_repos());
+        }
+        if (command == "subscribe") {
+            TagQuery query;
+            std::string error;
+            if (!TagQuery::decode(args, query, error)) return error_json(error);
+            return subscribe(fd, query);
         }
+        if (command == "stats") {
+            TagQuery query;
+            std::string error;
+            if (!TagQuery::decode(args, query, error)) return error_json(error);
+            return stats(query.repo);
+        }
+        return error_json("unknown command: " + std::string(command));
+    }
 
-        add_watch_recursive(directory_path);
-        
-        if (Utils::file_exists(ignore_file_path)) {
-            inotify_add_watch(inotify_fd, ignore_file_path.c_str(), IN_MODIFY);
-        }
-
-        watcher_thread = std::thread([this]() {
-            char buffer[32768];
-            fd_set read_fds;
-            while (running) {
-                FD_ZERO(&read_fds);
-                FD_SET(inotify_fd, &read_fds);
-                struct timeval timeout{1, 0};
-                if (select(inotify_fd + 1, &read_fds, nullptr, nullptr, &timeout) <= 0) continue;
-
-                ssize_t len = read(inotify_fd, buffer, sizeof(buffer) - 1);
-                if (len <= 0) continue;
-
-                for (ssize_t i = 0; i < len;) {
-                    auto* event = reinterpret_cast<inotify_event*>(&buffer[i]);
-                    
-                    std::string dir_path = "";
-                    auto wd_it = wd_to_path.find(event->wd);
-                    if (wd_it != wd_to_path.end()) {
-                        dir_path = wd_it->second;
-                    }
-                    
-                    std::string full_path = "";
-                    if (event->len > 0 && !dir_path.empty()) {
-                        full_path = dir_path + "/" + event->name;
-                    } else if (!dir_path.empty()) {
-                        full_path = dir_path;
-                    }
+    std::string stats(const std::string& repo) {
+        MetricsText out;
+        if (write_stats) write_stats(out, repo);
+        size_t subscribers = std::count_if(clients.begin(), clients.end(),
+                                           [](const auto& entry) { return entry.second.subscribed; });
+        out.gauge("codetags_socket_clients", "Open connections to the query socket.", "",
+                  static_cast<double>(clients.size()));
+        out.gauge("codetags_subscribers", "Connections streaming tag changes.", "", static_cast<double>(subscribers));
+        out.counter("codetags_change_events_total", "Tag changes published to subscribers.", "",
+                    static_cast<double>(feed->last()));
+        return out.str() + "# EOF";
+    }
 
-                    if (!dir_path.empty() && dir_path == directory_path && 
-                        event->len > 0 && std::string(event->name) == ".ctagsignore") {
-                        process_ignore_file_change();
-                    } 
-                    else if (event->mask & (IN_CREATE | IN_MOVED_TO) && (event->mask & IN_ISDIR)) {
-                        if (!full_path.empty()) {
-                            add_watch_recursive(full_path);
-                        }
-                    } 
-                    else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
-                        if (!full_path.empty()) {
-                            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                            process_file_event(full_path);
-                        }
-                    } 
-                    else if (event->mask & IN_MODIFY) {
-                        if (!full_path.empty()) {
-                            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                            process_file_event(full_path);
-                        }
-                    } 
-                    else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
-                        if (!full_path.empty()) {
-                            process_file_event(full_path);
-                        }
-                    }
-                    
-                    i += sizeof(inotify_event) + event->len;
-                }
-            }
-            close(inotify_fd);
-        });
+    static std::string answer(const TagQuery& query, const std::vector<Repo>& repos) {
+        auto selected = select_repos(query, repos);
+        if (selected.empty() && (!query.repo.empty() || !query.dir.empty())) {
+            return error_json("no registered repository matches " + (query.repo.empty() ? query.dir : query.repo));
+        }
 
-        {
-            std::lock_guard<std::mutex> lock(ignore_patterns_mutex);
-            last_known_mtime.clear();
+        std::optional<uint16_t> type;
+        if (!query.type.empty()) {
+            type = TagTypes::find(query.type);
+            if (!type) selected.clear();  // a type nobody has seen matches nothing
         }
-        
-        try {
-            for (const auto& entry : fs::recursive_directory_iterator(directory_path)) {
-                if (entry.is_regular_file()) {
-                    std::string fp = entry.path().string();
-                    if (!should_ignore(fp)) {
-                        process_file_event(fp);
-                    }
+        std::optional<uint32_t> id;
+        if (!query.id.empty()) {
+            std::string text = query.id;
+            std::transform(text.begin(), text.end(), text.begin(), ::toupper);
+            if (text.rfind("CT-", 0) != 0) text = "CT-" + text;
+            uint32_t value;
+            if (!Tag::parse_id(text, value)) return error_json("invalid id: " + query.id);
+            id = value;
+        }
+
+        // Matches point into these entries, which the snapshots keep alive
+        struct Match {
+            const Repo* repo;
+            const FileTags* file;
+            const Tag* tag;
+        };
+        std::vector<TagDatabase::Snapshot> snapshots;
+        std::vector<TagDatabase::FilePtr> files;
+        std::vector<Match> matches;
+        for (const Repo* repo : selected) {
+            auto collect = [&](const FileTags& file) {
+                for (const auto& tag : file.tags) {
+                    if (type && tag.type != *type) continue;
+                    if (id && tag.id != *id) continue;
+                    matches.push_back(Match{repo, &file, &tag});
+                }
+            };
+            if (!query.file.empty()) {
+                auto file = repo->db->get_tags_in_file(repo->path + "/" + query.file);
+                if (file) {
+                    collect(*file);
+                    files.push_back(std::move(file));
                 }
+            } else {
+                snapshots.push_back(repo->db->snapshot());
+                snapshots.back().for_each_file_with_prefix(repo->path + "/" + query.prefix, collect);
             }
-        } catch (const fs::filesystem_error& e) {
-            std::cerr << "[FileWatcher] Filesystem error during initial scan: " << e.what() << std::endl;
         }
+
+        size_t limit = std::min(query.limit, TagQuery::max_limit);
+        size_t begin = std::min(query.offset, matches.size());
+        size_t end = std::min(matches.size(), begin + limit);
+
+        // Only the requested page and what precedes it need ordering
+        std::partial_sort(matches.begin(), matches.begin() + end, matches.end(), [](const Match& a, const Match& b) {
+            if (a.repo != b.repo) return a.repo->name < b.repo->name;
+            if (a.file != b.file) return a.file->relative_path() < b.file->relative_path();
+            if (a.tag->line_number != b.tag->line_number) return a.tag->line_number < b.tag->line_number;
+            return a.tag->id < b.tag->id;
+        });
+        std::string out = "{\"total\":" + std::to_string(matches.size()) + ",\"offset\":" + std::to_string(begin) +
+                          ",\"limit\":" + std::to_string(limit) + ",\"next_offset\":" +
+                          (end < matches.size() ? std::to_string(end) : "null") + ",\"tags\":[";
+        for (size_t i = begin; i < end; ++i) {
+            const auto& m = matches[i];
+            if (i > begin) out += ',';
+            out += "{\"repo\":\"" + Utils::json_escape(m.repo->name) + "\"";
+            out += ",\"id\":\"" + Tag::format_id(m.tag->id) + "\"";
+            out += ",\"type\":\"" + Utils::json_escape(TagTypes::name(m.tag->type)) + "\"";
+            out += ",\"content\":\"" + Utils::json_escape(m.file->content(*m.tag)) + "\"";
+            out += ",\"file\":\"" + Utils::json_escape(m.file->relative_path()) + "\"";
+            out += ",\"line\":" + std::to_string(m.tag->line_number);
+            out += ",\"modified\":" + std::to_string(static_cast<long long>(m.file->last_modified)) + "}";
+        }
+        out += "]}";
+        return out;
     }
 
-    void stop() {
-        if (!running) return;
-        running = false;
-        
-        for (const auto& [wd, path] : wd_to_path) {
-            inotify_rm_watch(inotify_fd, wd);
+    // Client side: connects and sends one request line; returns the socket.
+    static int send_request(const std::string& path, const std::string& line) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) return -1;
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || !write_all(fd, line + "\n")) {
+            close(fd);
+            return -1;
         }
-        wd_to_path.clear();
-        path_to_wd.clear();
-        
-        if (watcher_thread.joinable()) watcher_thread.join();
-        if (inotify_fd >= 0) {
-            close(inotify_fd);
-            inotify_fd = -1;
+        return fd;
+    }
+
+    // Client side: sends one request line and reads back the response, up to
+    // and without the newline ending terminator.
+    static bool request(const std::string& path, const std::string& line, std::string& response,
+                        std::string_view terminator = "\n") {
+        int fd = send_request(path, line);
+        if (fd < 0) return false;
+        timeval timeout{5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        response.clear();
+        char buffer[65536];
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+            response.append(buffer, static_cast<size_t>(n));
+            if (response.ends_with(terminator)) break;
         }
+        close(fd);
+        if (!response.ends_with(terminator)) return false;
+        response.pop_back();
+        return true;
     }
 };
 
@@ -724,21 +5282,51 @@ struct Repository {
 
 class CodetagsDaemon {
 private:
-    std::atomic<bool> running{true};
     std::string config_dir;
     std::string registered_repos_file;
     std::unordered_map<std::string, Repository> monitored_repos;
     std::unordered_map<std::string, std::unique_ptr<FileWatcher>> repo_watchers;
     std::unordered_map<std::string, std::shared_ptr<TagDatabase>> repo_databases; // Per-repo databases
     std::mutex repos_mutex;
-    std::thread file_watcher;
     std::string daemon_pid_file;
+    std::string socket_path;
+    Config config;
+    EventLoop loop;
+    ChangeFeed feed;
+    std::unique_ptr<QueryServer> query_server;
+    std::shared_ptr<ThreadPool> pool;
+    sigset_t shutdown_signals;
+    std::atomic<uint64_t> registry_loads{0};
+    Histogram load_seconds;
+
+    static std::string read_inotify_names(int fd) {
+        alignas(inotify_event) char buffer[4096];
+        std::string names;
+        ssize_t len;
+        while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+            for (ssize_t i = 0; i < len;) {
+                auto* event = reinterpret_cast<inotify_event*>(&buffer[i]);
+                if (event->len > 0) names += std::string(event->name) + "\n";
+                i += sizeof(inotify_event) + event->len;
+            }
+        }
+        return names;
+    }
 
 public:
-    CodetagsDaemon() {
+    explicit CodetagsDaemon(const Config& cfg) : config(cfg) {
+        // SIGTERM and SIGINT are read from a signalfd by the event loop; they
+        // are blocked before the pool starts so every worker inherits the mask.
+        sigemptyset(&shutdown_signals);
+        sigaddset(&shutdown_signals, SIGTERM);
+        sigaddset(&shutdown_signals, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &shutdown_signals, nullptr);
+        pool = std::make_shared<ThreadPool>(cfg.worker_count());
+
         config_dir = Utils::get_home_dir() + "/.ctags";
         registered_repos_file = config_dir + "/registered_repos.txt";
         daemon_pid_file = config_dir + "/daemon.pid";
+        socket_path = config_dir + "/daemon.sock";
         fs::create_directories(config_dir);
         if (!fs::exists(registered_repos_file)) {
             std::ofstream f(registered_repos_file);
@@ -751,6 +5339,8 @@ public:
 
     void load_and_watch_repos() {
         std::lock_guard<std::mutex> lock(repos_mutex);
+        ScopedTimer timer(load_seconds);
+        registry_loads++;
 
         // Load all registered repos
         std::unordered_map<std::string, Repository> new_repos;
@@ -785,20 +5375,50 @@ public:
             monitored_repos.erase(name);
         }
 
-        // Add or update watchers for registered repos
+        // Add or update watchers for registered repos. start() only queues the
+        // initial scan on the pool, so this doesn't wait for it.
         for (const auto& [name, repo] : new_repos) {
             if (monitored_repos.find(name) == monitored_repos.end()) {
                 // Create a new database for this repo
                 auto repo_db = std::make_shared<TagDatabase>();
+                repo_db->set_change_listener([this, name = name](const std::vector<TagChange>& changes) {
+                    feed.publish(name, changes);
+                });
                 repo_databases[name] = repo_db;
                 
-                repo_watchers[name] = std::make_unique<FileWatcher>(repo.path, repo_db);
+                repo_watchers[name] = std::make_unique<FileWatcher>(repo.path, repo_db, pool, &loop, config,
+                                                                   config_dir + "/index");
                 repo_watchers[name]->start();
                 monitored_repos[name] = repo;
             }
         }
     }
 
+    // Samples of every repo (or just the named one) and of the daemon itself.
+    // Runs on the loop thread, where the repo set changes.
+    void write_metrics(MetricsText& out, const std::string& only) {
+        std::lock_guard<std::mutex> lock(repos_mutex);
+        std::vector<std::string> names;
+        for (const auto& [name, _] : repo_watchers) {
+            if (only.empty() || name == only) names.push_back(name);
+        }
+        std::sort(names.begin(), names.end());
+        for (const auto& name : names) repo_watchers[name]->write_metrics(out, MetricsText::label("repo", name));
+
+        out.gauge("codetags_repos", "Repositories monitored.", "", static_cast<double>(monitored_repos.size()));
+        out.gauge("codetags_worker_threads", "Threads scanning files.", "", static_cast<double>(config.worker_count()));
+        out.counter("codetags_registry_loads_total", "Loads of registered_repos.txt.", "",
+                    static_cast<double>(registry_loads));
+        out.histogram("codetags_registry_load_seconds", "Time to load the registry and start new repos.", "",
+                      load_seconds);
+        long pages = 0, resident = 0;
+        std::ifstream statm("/proc/self/statm");
+        if (statm >> pages >> resident) {
+            out.gauge("process_resident_memory_bytes", "Resident memory of the daemon.", "",
+                      static_cast<double>(resident) * sysconf(_SC_PAGESIZE));
+        }
+    }
+
     void run() {
         std::ofstream pid_file(daemon_pid_file);
         if (pid_file.is_open()) {
@@ -806,38 +5426,51 @@ public:
             pid_file.close();
         }
 
-        load_and_watch_repos();
-
-        int inotify_fd = inotify_init1(IN_NONBLOCK);
-        int wd = inotify_add_watch(inotify_fd, registered_repos_file.c_str(), IN_MODIFY);
-        if (wd < 0) {
-            close(inotify_fd);
+        // The registry is replaced by rename on removal, so watch its directory
+        int registry_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (registry_fd < 0 ||
+            inotify_add_watch(registry_fd, config_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            std::cerr << "[CodetagsDaemon] Failed to watch " << registered_repos_file << std::endl;
+            if (registry_fd >= 0) close(registry_fd);
             return;
         }
-
-        file_watcher = std::thread([this, inotify_fd, wd]() {
-            char buffer[4096];
-            fd_set read_fds;
-            while (running) {
-                FD_ZERO(&read_fds);
-                FD_SET(inotify_fd, &read_fds);
-                struct timeval timeout{1, 0};
-                if (select(inotify_fd + 1, &read_fds, nullptr, nullptr, &timeout) > 0) {
-                    if (read(inotify_fd, buffer, sizeof(buffer)) > 0) {
-                        load_and_watch_repos();
-                    }
-                }
+        std::string registry_name = fs::path(registered_repos_file).filename().string() + "\n";
+        loop.add(registry_fd, [this, registry_fd, registry_name] {
+            if (read_inotify_names(registry_fd).find(registry_name) != std::string::npos) {
+                load_and_watch_repos();
             }
-            inotify_rm_watch(inotify_fd, wd);
-            close(inotify_fd);
         });
 
-        while (running) std::this_thread::sleep_for(std::chrono::seconds(1));
+        int signal_fd = signalfd(-1, &shutdown_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (signal_fd >= 0) {
+            loop.add(signal_fd, [this] { loop.stop(); });
+        }
+
+        query_server = std::make_unique<QueryServer>(socket_path, &loop, [this] {
+            std::lock_guard<std::mutex> lock(repos_mutex);
+            std::vector<QueryServer::Repo> repos;
+            for (const auto& [name, repo] : monitored_repos) {
+                repos.push_back({name, repo.path, repo_databases[name]});
+            }
+            return repos;
+        }, &feed, [this](MetricsText& out, const std::string& repo) { write_metrics(out, repo); });
+        feed.set_notify([this] { loop.wake(); });
+        query_server->start();
+
+        load_and_watch_repos();
+        loop.run();
+        query_server->stop();
+
+        loop.remove(registry_fd);
+        close(registry_fd);
+        if (signal_fd >= 0) {
+            loop.remove(signal_fd);
+            close(signal_fd);
+        }
     }
 
     void stop() {
-        running = false;
-        if (file_watcher.joinable()) file_watcher.join();
+        loop.stop();
         std::lock_guard<std::mutex> lock(repos_mutex);
         for (auto& [_, w] : repo_watchers) w->stop();
 
@@ -847,6 +5480,255 @@ public:
     }
 };
 
+// ======================
+// BatchScan
+// ======================
+
+// codetags scan: one pass over a repo, for CI. No inotify and no watcher:
+// the walk and the parsing share one pool, a task per directory and one per
+// chunk of files, and each chunk's tags are printed as soon as it is done,
+// so their order varies from run to run. With --no-stamp nothing in the
+// tree is written; otherwise IDs are stamped and codetags.md is updated,
+// as the daemon would.
+class BatchScan {
+private:
+    static constexpr size_t chunk_size = 64;  // files per parse task
+
+    std::string repo_path;
+    const Config& config;
+    std::ostream& out;
+    std::shared_ptr<const TagMatcher> matcher;
+    std::shared_ptr<const IgnoreMatcher> ignore;
+    std::unique_ptr<TagDatabase> db;  // only when stamping, for the IDs and the render
+    ThreadPool pool;
+
+    // Tasks queued or running; the scan is over when none are left
+    std::atomic<size_t> pending{0};
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+
+    std::mutex out_mutex;  // out, and the totals below
+    std::map<uint16_t, size_t> found;  // tag type -> tags
+    size_t files_scanned = 0;
+    size_t files_skipped = 0;
+    std::unordered_set<std::string> stamped;  // a file may be stamped again by settle_duplicates
+    std::vector<std::string> contested;       // kept an ID another file of the scan holds
+
+    bool ignored(const std::string& path, bool is_dir) const {
+        return ignore->matches(std::string_view(path).substr(repo_path.size() + 1), is_dir);
+    }
+
+    static bool is_source(const std::string& path) {
+        return SourceTypes::of_path(path) != CommentStyle::NONE;
+    }
+
+    void run(std::function<void()> task) {
+        pending++;
+        pool.submit([this, task = std::move(task)] {
+            try {
+                task();
+            } catch (const std::exception& e) {
+                std::cerr << "[BatchScan] " << e.what() << std::endl;
+            }
+            if (--pending == 0) {
+                std::lock_guard<std::mutex> lock(done_mutex);
+                done_cv.notify_all();
+            }
+        });
+    }
+
+    void parse_later(std::vector<std::string> files) {
+        run([this, files = std::move(files)] { parse(files); });
+    }
+
+    void walk(const std::string& dir) {
+        std::vector<std::string> files;
+        std::error_code ec;
+        TreeWalk::list(
+            dir,
+            [this](const std::string& path, bool is_dir) {
+                return (!is_dir && !is_source(path)) || ignored(path, is_dir);
+            },
+            [&](std::string file) {
+                files.push_back(std::move(file));
+                if (files.size() == chunk_size) parse_later(std::exchange(files, {}));
+            },
+            [this](std::string sub) { run([this, sub = std::move(sub)] { walk(sub); }); }, ec);
+        if (!files.empty()) parse_later(std::move(files));
+        if (ec) std::cerr << "[BatchScan] Filesystem error while walking " << dir << ": " << ec.message() << std::endl;
+    }
+
+    void print(const FileTags& file, std::string& text) const {
+        std::string path = config.batch.format == BatchOptions::JSON ? Utils::json_escape(file.relative_path())
+                                                                      : std::string(file.relative_path());
+        for (const auto& tag : file.tags) {
+            std::string type = TagTypes::name(tag.type);
+            if (config.batch.format == BatchOptions::JSON) {
+                text += "{\"id\":";
+                text += tag.id ? "\"" + Tag::format_id(tag.id) + "\"" : "null";
+                text += ",\"type\":\"" + Utils::json_escape(type) + "\"";
+                text += ",\"content\":\"" + Utils::json_escape(file.content(tag)) + "\"";
+                text += ",\"file\":\"" + path + "\"";
+                text += ",\"line\":" + std::to_string(tag.line_number);
+                text += ",\"modified\":" + std::to_string(static_cast<long long>(file.last_modified)) + "}\n";
+            } else {
+                text += path + ":" + std::to_string(tag.line_number) + ": " + type + ": ";
+                text += file.content(tag);
+                if (tag.id) text += " [" + Tag::format_id(tag.id) + "]";
+                text += '\n';
+            }
+        }
+    }
+
+    // When stamping, conflicts between files of the scan are left to
+    // settle_duplicates, which parses the files losing an ID again, and
+    // nothing is printed until they are settled.
+    void parse(const std::vector<std::string>& files, bool again = false) {
+        TagParser parser(matcher, config.limits, db ? &db->ids() : nullptr);
+        if (!db) parser.read_only();
+        if (db && !again) parser.defer_all_conflicts();
+        std::vector<ParsedFile> parsed;
+        std::map<uint16_t, size_t> counts;
+        std::string text;
+        std::vector<std::string> written;
+        std::vector<std::string> kept_held_ids;
+        size_t scanned = 0;
+        size_t skipped = 0;
+        for (const auto& path : files) {
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0) continue;
+            scanned++;
+            TagParser::ParseInfo info;
+            auto tags = parser.parse_file(path, repo_path, st.st_mtime, &info);
+            if (info.skipped != TagParser::ParseInfo::NONE) skipped++;
+            if (info.written) written.push_back(path);
+            if (info.contested) kept_held_ids.push_back(path);
+            if (!tags) continue;
+            if (db) {
+                parsed.push_back(ParsedFile{path, tags, info.written ? info.written : FileStamp::from_stat(st)});
+                continue;
+            }
+            print(*tags, text);
+            for (const auto& tag : tags->tags) counts[tag.type]++;
+        }
+        if (db) db->replace_files(parsed);
+
+        std::lock_guard<std::mutex> lock(out_mutex);
+        out.write(text.data(), static_cast<std::streamsize>(text.size()));
+        for (const auto& [type, count] : counts) found[type] += count;
+        if (!again) {
+            files_scanned += scanned;
+            files_skipped += skipped;
+        }
+        stamped.insert(written.begin(), written.end());
+        contested.insert(contested.end(), kept_held_ids.begin(), kept_held_ids.end());
+    }
+
+    // Files of the scan holding the same ID, all but one of them copies: the
+    // first by path keeps it, whichever order the workers parsed them in,
+    // and the others are parsed again to replace it. As in the daemon, see
+    // FileWatcher::keeps_id, but with no index to say which file had it.
+    void settle_duplicates() {
+        if (contested.empty()) return;
+        std::unordered_map<IdIndex::Owner, std::string> paths;
+        db->snapshot().for_each_file(
+            [&](const FileTags& file) { paths.emplace(IdIndex::owner_of(file.file_path), file.file_path); });
+        std::sort(contested.begin(), contested.end());
+        IdIndex& ids = db->ids();
+        std::set<std::string> duplicates;
+        for (const auto& path : contested) {
+            auto tags = db->get_tags_in_file(path);
+            if (!tags) continue;
+            IdIndex::Owner owner = IdIndex::owner_of(path);
+            for (const auto& tag : tags->tags) {
+                IdIndex::Owner holder;
+                if (ids.claim(tag.id, owner, &holder)) continue;
+                auto it = paths.find(holder);
+                if (it != paths.end() && path < it->second) {
+                    ids.transfer(tag.id, holder, owner);
+                    duplicates.insert(it->second);
+                } else {
+                    duplicates.insert(path);
+                }
+            }
+        }
+        parse(std::vector<std::string>(duplicates.begin(), duplicates.end()), true);
+    }
+
+    // Everything found, in path order, once the IDs are settled.
+    void print_all() {
+        auto snapshot = db->snapshot();
+        std::vector<const FileTags*> files;
+        snapshot.for_each_file([&](const FileTags& file) { files.push_back(&file); });
+        std::sort(files.begin(), files.end(),
+                  [](const FileTags* a, const FileTags* b) { return a->file_path < b->file_path; });
+        std::string text;
+        for (const FileTags* file : files) {
+            text.clear();
+            print(*file, text);
+            out.write(text.data(), static_cast<std::streamsize>(text.size()));
+            for (const auto& tag : file->tags) found[tag.type]++;
+        }
+    }
+
+public:
+    BatchScan(std::string repo, const Config& cfg, std::ostream& output = std::cout)
+        : repo_path(std::move(repo)),
+          config(cfg),
+          out(output),
+          matcher(TagMatcher::load(repo_path + "/.ctagstypes")),
+          ignore(IgnoreMatcher::load(repo_path + "/.ctagsignore")),
+          db(cfg.batch.stamp ? std::make_unique<TagDatabase>() : nullptr),
+          pool(cfg.worker_count()) {}
+
+    // Scans the repo and returns the exit code: the highest --fail-on code
+    // of the types found, or 0.
+    int run() {
+        std::string git_dir = config.git_index ? GitIndex::find_git_dir(repo_path) : "";
+        std::vector<GitIndex::Entry> entries;
+        if (!git_dir.empty() && GitIndex::read(git_dir + "/index", entries)) {
+            std::vector<std::string> files;
+            for (const auto& entry : entries) {
+                std::string path = repo_path + "/" + entry.path;
+                if (!is_source(path) || ignored(path, false)) continue;
+                files.push_back(std::move(path));
+                if (files.size() == chunk_size) parse_later(std::exchange(files, {}));
+            }
+            if (!files.empty()) parse_later(std::move(files));
+        } else {
+            run([this] { walk(repo_path); });
+        }
+
+        // The calling thread works too, until the last task is done
+        while (pending > 0) {
+            if (pool.run_one()) continue;
+            std::unique_lock<std::mutex> lock(done_mutex);
+            done_cv.wait_for(lock, std::chrono::milliseconds(5), [&] { return pending == 0; });
+        }
+        if (db) {
+            settle_duplicates();
+            print_all();
+        }
+        out.flush();
+        if (db) CodetagsRenderer(repo_path, config.outputs).render(*db);
+
+        size_t total = 0;
+        int code = 0;
+        std::string by_type;
+        for (const auto& [type, count] : found) {
+            std::string name = TagTypes::name(type);
+            total += count;
+            by_type += (by_type.empty() ? ": " : ", ") + std::to_string(count) + " " + name;
+            auto it = config.batch.fail_on.find(name);
+            if (it != config.batch.fail_on.end()) code = std::max(code, it->second);
+        }
+        std::cerr << "Scanned " << files_scanned << " files (" << files_skipped << " skipped), found " << total
+                  << " tags" << by_type << "\n";
+        if (!stamped.empty()) std::cerr << "Stamped IDs into " << stamped.size() << " files\n";
+        return code;
+    }
+};
+
 // ======================
 // CodetagsApp
 // ======================
@@ -855,6 +5737,7 @@ class CodetagsApp {
 private:
     std::string config_dir;
     std::string registered_repos_file;
+    Config config;
 
     void kill_existing_daemon() {
         std::string daemon_pid_file = config_dir + "/daemon.pid";
@@ -875,7 +5758,7 @@ private:
     }
 
 public:
-    CodetagsApp() {
+    explicit CodetagsApp(const Config& cfg) : config(cfg) {
         config_dir = Utils::get_home_dir() + "/.ctags";
         registered_repos_file = config_dir + "/registered_repos.txt";
         fs::create_directories(config_dir);
@@ -914,8 +5797,8 @@ public:
 
         std::cout << "Codetags initialized in " << repo_path << ". Starting daemon in background...\n";
         
-        std::thread daemon_thread([]() {
-            CodetagsDaemon daemon;
+        std::thread daemon_thread([cfg = config]() {
+            CodetagsDaemon daemon(cfg);
             daemon.run();
         });
         daemon_thread.detach();
@@ -943,22 +5826,85 @@ public:
         fs::rename(registered_repos_file + ".tmp", registered_repos_file);
 
         fs::remove(repo_path + "/codetags.md");
+        std::error_code ec;
+        fs::remove_all(repo_path + "/.codetags", ec);
 
         std::cout << "Repository removed from monitoring\n";
     }
 
-    void scan_current() {
-        auto repo_path = fs::current_path().string();
-        auto db = std::make_shared<TagDatabase>();
-        FileWatcher watcher(repo_path, db);
-        watcher.start();
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        watcher.stop();
-        std::cout << "Manual scan completed.\n";
+    int scan() {
+        return BatchScan(fs::current_path().string(), config).run();
+    }
+
+    int query(int argc, char* argv[], int first) {
+        TagQuery query;
+        bool all_repos = false;
+        if (!TagQuery::parse_args(argc, argv, first, query, all_repos)) return 1;
+        if (query.repo.empty() && !all_repos) query.dir = fs::current_path().string();
+
+        std::string response;
+        if (!QueryServer::request(config_dir + "/daemon.sock", "query " + query.encode(), response)) {
+            std::cerr << "Could not reach the codetags daemon; is it running?\n";
+            return 1;
+        }
+        std::cout << response << "\n";
+        return response.rfind("{\"error\"", 0) == 0 ? 1 : 0;
+    }
+
+    // Prints the daemon's change events as they happen, until it goes away.
+    int subscribe(int argc, char* argv[], int first) {
+        TagQuery query;
+        bool all_repos = false;
+        if (!TagQuery::parse_args(argc, argv, first, query, all_repos)) return 1;
+        if (query.repo.empty() && !all_repos) query.dir = fs::current_path().string();
+
+        int fd = QueryServer::send_request(config_dir + "/daemon.sock", "subscribe " + query.encode());
+        if (fd < 0) {
+            std::cerr << "Could not reach the codetags daemon; is it running?\n";
+            return 1;
+        }
+        char buffer[65536];
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+            std::cout.write(buffer, n);
+            std::cout.flush();
+        }
+        close(fd);
+        return 0;
+    }
+
+    // Prints the daemon's metrics in the Prometheus text format, or writes
+    // them atomically to a file, e.g. for node_exporter's textfile collector.
+    int stats(int argc, char* argv[], int first) {
+        std::string repo, out_path;
+        for (int i = first; i < argc; ++i) {
+            std::string arg = argv[i];
+            if ((arg == "--repo" || arg == "--out") && i + 1 < argc) {
+                (arg == "--repo" ? repo : out_path) = argv[++i];
+            } else {
+                std::cerr << "Usage: codetags stats [--repo NAME] [--out FILE]\n";
+                return 1;
+            }
+        }
+
+        std::string response;
+        if (!QueryServer::request(config_dir + "/daemon.sock", "stats repo=" + Utils::url_encode(repo), response,
+                                  "# EOF\n")) {
+            std::cerr << "Could not reach the codetags daemon; is it running?\n";
+            return 1;
+        }
+        response += "\n";
+        if (out_path.empty()) {
+            std::cout << response;
+        } else if (!Utils::write_file_atomic(out_path, [&](std::ostream& out) { out << response; })) {
+            std::cerr << "Could not write " << out_path << "\n";
+            return 1;
+        }
+        return 0;
     }
 
     void run_daemon() {
-        CodetagsDaemon daemon;
+        CodetagsDaemon daemon(config);
         daemon.run();
     }
 };
@@ -967,22 +5913,51 @@ public:
 // main
 // ======================
 
+#ifndef CODETAGS_NO_MAIN  // defined by builds that reuse this file, e.g. bench/bench.cpp
 int main(int argc, char* argv[]) {
-    CodetagsApp app;
     if (argc < 2) {
         std::cout << "Usage: codetags <command>\n";
         std::cout << "Commands:\n";
         std::cout << "  init     - Initialize codetags in current directory\n";
         std::cout << "  remove   - Remove current directory from monitoring\n";
-        std::cout << "  scan     - Scan current directory for tags\n";
+        std::cout << "  scan     - Scan current directory once and print its tags (no daemon)\n";
         std::cout << "  daemon   - Run the background daemon\n";
+        std::cout << "  query    - Ask the daemon for tags, as JSON\n";
+        std::cout << "  subscribe - Stream tag changes from the daemon, as JSON lines\n";
+        std::cout << "  stats    - Print the daemon's metrics (Prometheus text; --repo NAME, --out FILE)\n";
+        std::cout << "Options:\n";
+        std::cout << "  --jobs N          - Worker threads for scanning (default: all cores)\n";
+        std::cout << "  --debounce-ms MS  - Quiet time before a changed file is parsed (default: 100)\n";
+        std::cout << "  --flush-ms MS     - Minimum time between codetags.md writes (default: 500)\n";
+        std::cout << "  --git-index       - Scan only files tracked in .git/index\n";
+        std::cout << "  --max-file-kb KB  - Skip files larger than this (default: 8192)\n";
+        std::cout << "  --max-line-kb KB  - Skip lines longer than this (default: 64)\n";
+        std::cout << "  --outputs LIST    - Files to write: md,jsonl,bin (default: md)\n";
+        std::cout << "  --split-md HOW    - type or dir: one markdown file per tag type or top-level dir\n";
+        std::cout << "Scan options:\n";
+        std::cout << "  --format text|json      - Output format (default: text)\n";
+        std::cout << "  --no-stamp              - Don't write IDs or codetags.md; leave the tree as it is\n";
+        std::cout << "  --fail-on TYPE[=CODE]   - Exit with CODE (default 1) if a tag of TYPE is found\n";
+        std::cout << "Query options:\n";
+        std::cout << "  --type T, --file F, --prefix P, --id ID  - Filters (paths relative to the repo root)\n";
+        std::cout << "  --repo NAME | --all                      - Repo to query (default: the current one)\n";
+        std::cout << "  --offset N, --limit N                    - Page through results (default limit: 100)\n";
+        std::cout << "  --since SEQ --epoch E                    - subscribe: resume after event SEQ\n";
         return 1;
     }
 
     std::string cmd = argv[1];
+    if (cmd == "query") return CodetagsApp(Config{}).query(argc, argv, 2);
+    if (cmd == "subscribe") return CodetagsApp(Config{}).subscribe(argc, argv, 2);
+    if (cmd == "stats") return CodetagsApp(Config{}).stats(argc, argv, 2);
+
+    Config config;
+    if (!Config::parse(argc, argv, 2, config)) return 1;
+
+    CodetagsApp app(config);
     if (cmd == "init") app.init();
     else if (cmd == "remove") app.remove();
-    else if (cmd == "scan") app.scan_current();
+    else if (cmd == "scan") return app.scan();
     else if (cmd == "daemon") app.run_daemon();
     else {
         std::cerr << "Unknown command: " << cmd << "\n";
@@ -990,3 +5965,4 @@ int main(int argc, char* argv[]) {
     }
     return 0;
 }
+#endif